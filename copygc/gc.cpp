@@ -1,27 +1,382 @@
 #include <new>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <time.h>
+#endif
 #include "gc.h"
 
 namespace GC 
 { 
+    const size_t BITS_PER_WORD = sizeof(size_t)*8;
+    const size_t INIT_LARGE_OBJECTS = 16; // initial size of the table of large objects
+    const size_t DEFAULT_MEMORY_DECAY = 10*1000; // msec
+    const size_t INIT_REMEMBERED_SET_SIZE = 64;
+    const size_t UNCONFIRMED_EPOCH = (size_t)-2; // epoch of cross-heap reference stored by barrier: it is above epoch of any GC
+
     ThreadContext<MemoryAllocator> MemoryAllocator::ctx;
+    size_t volatile MemoryAllocator::nAllocators;
+    MemoryAllocator* MemoryAllocator::allocators;
+    Mutex MemoryAllocator::allocatorsMutex;
     
-    Object* MemoryAllocator::_allocate(size_t size) 
+    /**
+     * Map region of virtual memory from OS
+     */
+    static void* mapMemory(size_t size)
+    {
+#ifdef _WIN32
+        return VirtualAlloc(NULL, size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+#else
+        void* addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        return addr != MAP_FAILED ? addr : NULL;
+#endif
+    }
+
+    /**
+     * Return region of virtual memory to OS
+     */
+    static void unmapMemory(void* addr, size_t size)
+    {
+#ifdef _WIN32
+        VirtualFree(addr, 0, MEM_RELEASE);
+#else
+        munmap(addr, size);
+#endif
+    }
+
+    /**
+     * Atomically replace pointer if it has expected value
+     * @return true if pointer is replaced
+     */
+    static inline bool atomicCompareAndSwap(void* volatile* ptr, void* expected, void* value)
+    {
+#ifdef _WIN32
+        return InterlockedCompareExchangePointer(ptr, value, expected) == expected;
+#else
+        return __sync_bool_compare_and_swap(ptr, expected, value);
+#endif
+    }
+
+    MemorySegment** volatile SegmentMap::root[1 << SegmentMap::ROOT_BITS];
+
+    void SegmentMap::set(MemorySegment* segment, MemorySegment* value)
+    {
+        for (size_t offs = 0; offs < segment->size; offs += (size_t)1 << CHUNK_BITS) { 
+            size_t chunk = ((size_t)segment + offs) >> CHUNK_BITS;
+            if ((chunk >> LEAF_BITS) >= ((size_t)1 << ROOT_BITS)) { 
+                return;
+            }
+            MemorySegment** volatile* leafRef = &root[chunk >> LEAF_BITS];
+            if (*leafRef == NULL) { 
+                if (value == NULL) { 
+                    return;
+                }
+                MemorySegment** leaf = (MemorySegment**)calloc((size_t)1 << LEAF_BITS, sizeof(MemorySegment*));
+                if (leaf == NULL) { 
+                    return;
+                }
+                if (!atomicCompareAndSwap((void* volatile*)leafRef, NULL, leaf)) { // leaf was concurrently created by other thread
+                    free(leaf);
+                }
+            }
+            (*leafRef)[chunk & ((1 << LEAF_BITS) - 1)] = value;
+        }
+    }
+
+    /**
+     * Map segment of the specified size from OS and register it in segment map
+     */
+    static MemorySegment* mapSegment(size_t size, MemoryAllocator* owner)
+    {
+        MemorySegment* segment = (MemorySegment*)mapMemory(size);
+        if (segment != NULL) { 
+            segment->owner = owner;
+            segment->size = size;
+            SegmentMap::set(segment, segment);
+        }
+        return segment;
+    }
+
+    /**
+     * Remove segment from segment map and return it to OS
+     */
+    static void unmapSegment(MemorySegment* segment)
+    {
+        SegmentMap::set(segment, NULL);
+        unmapMemory(segment, segment->size);
+    }
+
+    /**
+     * Monotonic time in milliseconds
+     */
+    static size_t getCurrentTime()
+    {
+#ifdef _WIN32
+        return (size_t)GetTickCount64();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (size_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#endif
+    }
+
+    RememberedSet::RememberedSet()
+    {
+        table = NULL;
+        used = allocated = 0;
+    }
+
+    RememberedSet::~RememberedSet()
+    {
+        free(table);
+    }
+
+    void RememberedSet::add(Object* obj, MemoryAllocator* source, size_t epoch)
+    {
+        if ((used + 1)*3 > allocated*2) { // keep load factor below 2/3
+            Entry* oldTable = table;
+            size_t oldSize = allocated;
+            allocated = allocated == 0 ? INIT_REMEMBERED_SET_SIZE : allocated*2;
+            table = (Entry*)calloc(allocated, sizeof(Entry));
+            assert(table != NULL);
+            used = 0;
+            for (size_t i = 0; i < oldSize; i++) { 
+                if (oldTable[i].obj != NULL) { 
+                    add(oldTable[i].obj, oldTable[i].source, oldTable[i].epoch);
+                }
+            }
+            free(oldTable);
+        }
+        size_t mask = allocated - 1;
+        for (size_t i = ((size_t)obj / sizeof(ObjectHeader) ^ (size_t)source / sizeof(MemoryAllocator)) & mask;; i = (i + 1) & mask) { 
+            Entry* e = &table[i];
+            if (e->obj == NULL) { 
+                e->obj = obj;
+                e->source = source;
+                e->epoch = epoch;
+                used += 1;
+                return;
+            }
+            if (e->obj == obj && e->source == source) { 
+                if (e->epoch < epoch) { 
+                    e->epoch = epoch;
+                }
+                return;
+            }
+        }
+    }
+
+    void RememberedSet::purge(MemoryAllocator* source, size_t epoch)
+    {
+        for (size_t i = 0; i < allocated; i++) { // entry stored by barrier before purge is either found by the next GC of the source or removed by it
+            if (table[i].obj != NULL && table[i].source == source && table[i].epoch == UNCONFIRMED_EPOCH) { 
+                table[i].epoch = epoch;
+            }
+        }
+        remove(source, epoch);
+    }
+
+    void RememberedSet::remove(MemoryAllocator* source, size_t epoch)
+    {
+        size_t i, n = 0;
+        for (i = 0; i < allocated; i++) { 
+            n += table[i].obj != NULL && table[i].source == source && table[i].epoch < epoch;
+        }
+        if (n == 0) { 
+            return;
+        }
+        // Entries can not be removed from hash table with open addressing in place: rebuild the table
+        Entry* oldTable = table;
+        table = (Entry*)calloc(allocated, sizeof(Entry));
+        assert(table != NULL);
+        used = 0;
+        for (i = 0; i < allocated; i++) { 
+            Entry* e = &oldTable[i];
+            if (e->obj != NULL && (e->source != source || e->epoch >= epoch)) { 
+                add(e->obj, e->source, e->epoch);
+            }
+        }
+        free(oldTable);
+    }
+
+    void MemoryAllocator::releaseFreeSegments(size_t releaseTime)
+    {
+        MemorySegment *segment, *next, **sp = &freeSegment;
+        // Free segments are ordered by time of their release, so expired segments form tail of the list
+        while ((segment = *sp) != NULL && segment->freeTime > releaseTime) { 
+            sp = &segment->next;
+        }
+        *sp = NULL;
+        for (; segment != NULL; segment = next) { 
+            next = segment->next;
+            unmapSegment(segment);
+        }
+    }
+
+    void MemoryAllocator::decayFreeSegments()
+    {
+        if (memoryDecay != (size_t)-1 && freeSegment != NULL) { 
+            size_t now = getCurrentTime();
+            if (now >= memoryDecay) { 
+                releaseFreeSegments(now - memoryDecay);
+            }
+        }
+    }
+
+    void MemoryAllocator::_releaseMemory()
+    {
+        releaseFreeSegments((size_t)-1);
+    }
+
+    void MemoryAllocator::setMemoryDecay(size_t decayTime)
+    {
+        memoryDecay = decayTime;
+        decayFreeSegments();
+    }
+
+    ObjectHeader* MemoryAllocator::allocateLarge(size_t size)
+    {
+        size_t segmentSize = sizeof(LargeObjectSegment) + size;
+        LargeObjectSegment* segment = (LargeObjectSegment*)mapSegment(segmentSize, this);
+        if (segment == NULL) { 
+            return NULL;
+        }
+        if (nLargeObjects == maxLargeObjects) { 
+            size_t oldWords = (maxLargeObjects + BITS_PER_WORD - 1) / BITS_PER_WORD;
+            size_t newMax = maxLargeObjects == 0 ? INIT_LARGE_OBJECTS : maxLargeObjects*2;
+            size_t newWords = (newMax + BITS_PER_WORD - 1) / BITS_PER_WORD;
+            LargeObjectSegment** newObjects = (LargeObjectSegment**)realloc(largeObjects, newMax*sizeof(LargeObjectSegment*));
+            if (newObjects == NULL) { 
+                unmapSegment(segment);
+                return NULL;
+            }
+            largeObjects = newObjects;
+            size_t* newMarks = (size_t*)realloc(largeObjectMarks, newWords*sizeof(size_t));
+            if (newMarks == NULL) { // table of large objects is already extended, but it is harmless
+                unmapSegment(segment);
+                return NULL;
+            }
+            largeObjectMarks = newMarks;
+            memset(largeObjectMarks + oldWords, 0, (newWords - oldWords)*sizeof(size_t));
+            maxLargeObjects = newMax;
+        }
+        segment->next = (MemorySegment*)MemorySegment::LARGE_OBJECT;
+        segment->index = nLargeObjects;
+        largeObjects[nLargeObjects++] = segment;
+        if (clonedObject != NULL) { // object is created by GC, so it is live
+            markLargeObject(segment);
+        }
+        ObjectHeader* hdr = (ObjectHeader*)(segment + 1);
+        hdr->segment = segment;
+        return hdr;
+    }
+
+    bool MemoryAllocator::markLargeObject(LargeObjectSegment* segment)
+    {
+        size_t* word = &largeObjectMarks[segment->index / BITS_PER_WORD];
+        size_t mask = (size_t)1 << (segment->index % BITS_PER_WORD);
+        if (*word & mask) { 
+            return false;
+        }
+        *word |= mask;
+        return true;
+    }
+
+    bool MemoryAllocator::isLargeObjectMarked(LargeObjectSegment* segment) const
+    {
+        return (largeObjectMarks[segment->index / BITS_PER_WORD] >> (segment->index % BITS_PER_WORD)) & 1;
+    }
+
+    size_t MemoryAllocator::sweepLargeObjects()
+    {
+        size_t live = 0;
+        for (size_t i = nLargeObjects; i-- != 0;) { 
+            LargeObjectSegment* segment = largeObjects[i];
+            if (isLargeObjectMarked(segment)) { 
+                live += segment->size - sizeof(LargeObjectSegment);
+            } else { 
+                unmapSegment(segment);
+                if (i != --nLargeObjects) { // move last (already checked) entry to the released position
+                    LargeObjectSegment* last = largeObjects[nLargeObjects];
+                    largeObjects[i] = last;
+                    last->index = i;
+                }
+            }
+        }
+        memset(largeObjectMarks, 0, (nLargeObjects + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(size_t));
+        return live;
+    }
+
+    void MemoryAllocator::setAdaptiveThreshold(size_t growth, size_t minSize, size_t maxSize)
+    {
+        growthPercent = growth;
+        minThreshold = minSize;
+        maxThreshold = maxSize;
+        autoStartPercent = autoStartThreshold == (size_t)-1 ? 0 
+            : startThreshold >= 100 ? autoStartThreshold / (startThreshold / 100) : 100;
+    }
+
+    void MemoryAllocator::adjustThresholds()
+    {
+        if (growthPercent != 0) { 
+            size_t threshold = liveObjectsSize / 100 * growthPercent;
+            threshold = threshold < minThreshold ? minThreshold : threshold > maxThreshold ? maxThreshold : threshold;
+            startThreshold = threshold;
+            if (autoStartPercent != 0) { 
+                autoStartThreshold = threshold / 100 * autoStartPercent;
+            }
+        }
+    }
+
+    void MemoryAllocator::setLargeObjectThreshold(size_t threshold)
+    {
+        largeObjectThreshold = threshold;
+    }
+
+    void MemoryAllocator::adjustUsedLimit()
+    {
+        if (clonedObject != NULL || usedSegment == NULL || allocated > autoStartThreshold) { 
+            usedLimit = 0;
+        } else { 
+            size_t available = autoStartThreshold - allocated;
+            size_t rest = used < defaultSegmentSize ? defaultSegmentSize - used : 0;
+            usedLimit = used + (available < rest ? available : rest);
+        }
+    }
+
+    Object* MemoryAllocator::allocateSlow(size_t size) 
     {     
         if (allocated > autoStartThreshold) {
             gc();
         }
-        size = (size + sizeof(ObjectHeader) + 7) & ~7; // align on 8
+        if (size >= largeObjectThreshold) { 
+            ObjectHeader* hdr = allocateLarge(size);
+            if (hdr == NULL) { 
+                return NULL;
+            }
+            Object* obj = (Object*)(hdr + 1);
+            if (clonedObject != NULL) { // size of live large objects is calculated by sweepLargeObjects()
+                clonedObject->getHeader()->copy = (size_t)obj | ObjectHeader::GC_COPIED;
+            } else { 
+                allocated += size;
+            }
+            adjustUsedLimit();
+            return obj;
+        }
         if (used + size > defaultSegmentSize) { 
             MemorySegment* newSegment = freeSegment;
             if (newSegment == NULL || size > defaultSegmentSize) { 
+                newSegment = mapSegment(sizeof(MemorySegment) + (size > defaultSegmentSize ? size : defaultSegmentSize), this);
+                if (newSegment == NULL) { 
+                    return NULL;
+                }
                 if (size > defaultSegmentSize) { 
-                    newSegment = (MemorySegment*)malloc(sizeof(MemorySegment)  + size);
                     newSegment->next = (MemorySegment*)((size_t)usedSegment + MemorySegment::LARGE_SEGMENT);
                 } else { 
-                    newSegment = (MemorySegment*)malloc(sizeof(MemorySegment)  + defaultSegmentSize);
                     newSegment->next = usedSegment;
                 }
-                newSegment->owner = this;
             } else { 
                 newSegment = freeSegment;
                 freeSegment = newSegment->next;
@@ -35,8 +390,10 @@ namespace GC
         used += size;
         allocated += size;
         hdr->segment = usedSegment;
-        if (clonedObject != NULL) {             
+        if (clonedObject != NULL) { // fast path stays disabled while objects are cloned
             clonedObject->getHeader()->copy = (size_t)obj | ObjectHeader::GC_COPIED;
+        } else { 
+            adjustUsedLimit();
         }
         return obj;
     }
@@ -83,20 +440,108 @@ namespace GC
     {
         if (obj != NULL) { 
             ObjectHeader* hdr = obj->getHeader();
-            if (hdr->copy & ObjectHeader::GC_COPIED) { 
+            if ((hdr->copy & (ObjectHeader::GC_COPIED|ObjectHeader::GC_PINNED)) == ObjectHeader::GC_COPIED) { 
                 return (Object*)(hdr->copy - ObjectHeader::GC_COPIED);
-            } else if ((Object*)hdr->copy == obj) { // pinned object
-                hdr->copy = (size_t)obj + ObjectHeader::GC_COPIED;
-                (void)obj->clone(this);
-            } else if (hdr->segment->owner == this) { 
-                clonedObject = obj;
-                obj = obj->clone(this);
-                clonedObject = NULL;
+            }
+            MemorySegment* segment = hdr->getSegment();
+            if (segment->owner != this) { // object of other heap is not copied, but it is kept in place by GC of its owner while this reference is found
+                segment->owner->rememberIncoming(obj, this, epoch);
+            } else if (hdr->copy & ObjectHeader::GC_PINNED) { 
+                if (!(hdr->copy & ObjectHeader::GC_COPIED)) { 
+                    hdr->copy |= ObjectHeader::GC_COPIED;
+                    (void)obj->clone(this);
+                }
+            } else { 
+                if (segment->isLargeObject()) { // large objects are not moved by _move(): just their references are updated
+                    if (markLargeObject((LargeObjectSegment*)segment)) { 
+                        Object* saveClonedObject = clonedObject;
+                        clonedObject = obj;
+                        usedLimit = 0; // custom clone() may still allocate new copy of the object
+                        Object* copy = obj->clone(this);
+                        if (copy != obj) { // the old location is not live any more
+                            largeObjectMarks[((LargeObjectSegment*)segment)->index / BITS_PER_WORD] &= ~((size_t)1 << (((LargeObjectSegment*)segment)->index % BITS_PER_WORD));
+                            obj = copy;
+                        }
+                        clonedObject = saveClonedObject;
+                        adjustUsedLimit();
+                    }
+                } else { 
+                    clonedObject = obj;
+                    usedLimit = 0; // cloned object should be allocated by slow path to be forwarded
+                    obj = obj->clone(this);
+                    clonedObject = NULL; // fast path is enabled again by next slow allocation or at the end of GC
+                }
             }
         }
         return obj;
     }
 
+    Object* MemoryAllocator::_move(Object* obj, size_t size)
+    {
+        if (obj != clonedObject) { // pinned object: references are updated in place
+            return obj;
+        }
+        if (obj->getHeader()->segment->isLargeObject()) { // large object: references are updated in place
+            clonedObject = NULL;
+            adjustUsedLimit();
+            return obj;
+        }
+        Object* copy = _allocate(size);
+        assert(copy != NULL); // copying GC can not proceed without memory for copies
+        memcpy((void*)copy, (void*)obj, size);
+        return copy;
+    }
+
+    void MemoryAllocator::pinObject(Object* obj)
+    {
+        ObjectHeader* hdr = obj->getHeader();
+        if (hdr->copy & ObjectHeader::GC_PINNED) { // already pinned
+            return;
+        }
+        MemorySegment* segment = hdr->segment;
+        if (segment->owner != this || segment->isLargeObject()) { // large objects are never moved
+            return;
+        }
+        segment->next = (MemorySegment*)((size_t)segment->next | MemorySegment::PINNED_SEGMENT);
+        hdr->copy = (size_t)segment | ObjectHeader::GC_PINNED;
+    }
+
+    void MemoryAllocator::unpinObject(Object* obj)
+    {
+        ObjectHeader* hdr = obj->getHeader();
+        if ((hdr->copy & ObjectHeader::GC_PINNED) && hdr->getSegment()->owner == this) { // restore reference to segment
+            hdr->segment = hdr->getSegment();
+        }
+    }
+
+    void MemoryAllocator::rememberReference(void const* field, Object const* obj)
+    {
+        MemorySegment* segment = SegmentMap::find(field);
+        if (segment != NULL) { // reference is located in heap
+            MemoryAllocator* owner = obj->getHeader()->getSegment()->owner;
+            if (owner != segment->owner) { 
+                owner->rememberIncoming((Object*)obj, segment->owner, UNCONFIRMED_EPOCH); // epoch of the source is not read by other threads
+            }
+        }
+    }
+
+    void MemoryAllocator::rememberIncoming(Object* obj, MemoryAllocator* source, size_t epoch)
+    {
+        CriticalSection cs(incomingMutex);
+        incoming.add(obj, source, epoch);
+    }
+
+    void MemoryAllocator::purgeOutgoing()
+    {
+        CriticalSection cs(allocatorsMutex);
+        for (MemoryAllocator* owner = allocators; owner != NULL; owner = owner->nextAllocator) { 
+            if (owner != this) { 
+                CriticalSection ocs(owner->incomingMutex);
+                owner->incoming.purge(this, epoch);
+            }
+        }
+    }
+
     void MemoryAllocator::_copy(Object** refs, size_t nRefs) 
     {  
         for (size_t i = 0; i < nRefs; i++) { 
@@ -111,20 +556,12 @@ namespace GC
         }
     }
 
-    MemoryAllocator* MemoryAllocator::getCurrent() 
-    { 
-        MemoryAllocator* allocator = ctx.get();
-        assert(allocator != NULL);
-        return allocator;
-    }
-
     size_t MemoryAllocator::totalAllocated() { 
         return getCurrent()->_totalAllocated();
     }
 
-    Object* MemoryAllocator::allocate(size_t size) 
-    {
-        return getCurrent()->_allocate(size);
+    size_t MemoryAllocator::liveSize() { 
+        return getCurrent()->_liveSize();
     }
 
     void MemoryAllocator::visit(AnyWeakRef* wref) 
@@ -135,16 +572,6 @@ namespace GC
         }
     }
 
-    void MemoryAllocator::registerRoot(Root* root) 
-    {
-        getCurrent()->_registerRoot(root);
-    }
-            
-    void MemoryAllocator::unregisterRoot(Root* root) 
-    {
-        getCurrent()->_unregisterRoot(root);
-    }
-
     Object* MemoryAllocator::copy(Object* obj)
     {
         if (obj != NULL) {
@@ -176,31 +603,70 @@ namespace GC
         getCurrent()->_allowGC();
     } 
 
+    void MemoryAllocator::releaseMemory()
+    { 
+        getCurrent()->_releaseMemory();
+    } 
+
     MemoryAllocator::MemoryAllocator(size_t segmentSize, size_t gcStartThreshold, size_t gcAutoStartThreshold)
     {
         usedSegment = NULL;
         freeSegment = NULL;
         used = defaultSegmentSize = segmentSize;
+        usedLimit = 0;
         allocated = 0;
         roots = NULL;
         clonedObject = NULL;
         pinnedObjects = NULL;
+        memoryDecay = DEFAULT_MEMORY_DECAY;
+        largeObjectThreshold = segmentSize;
+        largeObjects = NULL;
+        largeObjectMarks = NULL;
+        nLargeObjects = 0;
+        maxLargeObjects = 0;
         startThreshold = gcStartThreshold;
         autoStartThreshold = gcAutoStartThreshold;
+        liveObjectsSize = 0;
+        growthPercent = 0;
+        autoStartPercent = 0;
+        minThreshold = 0;
+        maxThreshold = (size_t)-1;
+        epoch = 0;
+        {
+            CriticalSection cs(allocatorsMutex);
+            nextAllocator = allocators;
+            allocators = this;
+            nAllocators += 1;
+        }
         ctx.set(this);
     }
 
     MemoryAllocator::~MemoryAllocator()
     {
-        MemorySegment *curr, *next;
-        for (curr = freeSegment; curr != NULL; curr = next) { 
-            next = curr->next;
-            delete curr;
+        {
+            CriticalSection cs(allocatorsMutex);
+            MemoryAllocator** app = &allocators;
+            while (*app != this) { 
+                app = &(*app)->nextAllocator;
+            }
+            *app = nextAllocator;
+            nAllocators -= 1;
+            for (MemoryAllocator* owner = allocators; owner != NULL; owner = owner->nextAllocator) { // references from this heap are destroyed
+                CriticalSection ocs(owner->incomingMutex);
+                owner->incoming.remove(this, (size_t)-1); // including entries not confirmed by GC of this allocator
+            }
         }
+        MemorySegment *curr, *next;
+        _releaseMemory();
         for (curr = usedSegment; curr != NULL; curr = next) { 
             next = (MemorySegment*)((size_t)curr->next & ~MemorySegment::MASK);
-            delete curr;
+            unmapSegment(curr);
+        }
+        for (size_t i = 0; i < nLargeObjects; i++) { 
+            unmapSegment(largeObjects[i]);
         }
+        free(largeObjects);
+        free(largeObjectMarks);
     }
 
     void MemoryAllocator::_gc() 
@@ -208,22 +674,45 @@ namespace GC
         size_t saveStartThreshold = autoStartThreshold;
         MemorySegment* old = usedSegment;
 
+        epoch += 1; // references to objects of other heaps are confirmed by this GC
+        size_t nRemembered = 0;
+        Object** remembered;
+        {
+            CriticalSection cs(incomingMutex); // objects are copied without holding the lock: it is taken by _copy() for foreign objects
+            remembered = (Object**)malloc((incoming.capacity() + 1)*sizeof(Object*));
+            assert(remembered != NULL);
+            for (size_t i = 0, n = incoming.capacity(); i < n; i++) { 
+                if (incoming.at(i).obj != NULL) { 
+                    remembered[nRemembered++] = incoming.at(i).obj;
+                }
+            }
+        }
+
         // Garbage collector will copy accessible objects in new segments
         usedSegment = NULL;
         autoStartThreshold = (size_t)-1; // disable recusrive start of GC
         used = defaultSegmentSize;
+        usedLimit = 0;
+        allocated = 0; // size of copied objects
         weakReferences = NULL;
+        if (nLargeObjects != 0) { // large objects may be marked by deep copy outside GC
+            memset(largeObjectMarks, 0, (nLargeObjects + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(size_t));
+        }
         
-        // First of all pin objects
+        // First of all pin objects (including objects referenced from other heaps)
         for (Pin* pin = pinnedObjects; pin != NULL; pin = pin->next) { 
-            ObjectHeader* hdr = pin->obj->getHeader();
-            hdr->segment->next = (MemorySegment*)((size_t)hdr->segment->next | MemorySegment::PINNED_SEGMENT);
-            hdr->copy = (size_t)pin->obj;            
+            pinObject(pin->obj);
+        }
+        for (size_t i = 0; i < nRemembered; i++) { 
+            pinObject(remembered[i]);
         }
         // Now clone objects referenced from pinned objects
         for (Pin* pin = pinnedObjects; pin != NULL; pin = pin->next) { 
             (void)_copy(pin->obj);
         }
+        for (size_t i = 0; i < nRemembered; i++) { 
+            (void)_copy(remembered[i]);
+        }
         // And finally copy and adjust all roots
         for (Root* root = roots; root != NULL; root = root->next) { 
             root->copy(this); 
@@ -232,31 +721,54 @@ namespace GC
         for (AnyWeakRef* wref = weakReferences; wref != NULL; wref = wref->next) { 
             ObjectHeader* hdr = wref->obj->getHeader();
             if (hdr->copy & ObjectHeader::GC_COPIED) { 
-                wref->obj = (Object*)(hdr->copy - ObjectHeader::GC_COPIED);
-            } else if (hdr->segment->owner == this) {
-                wref->obj = NULL;
+                if (!(hdr->copy & ObjectHeader::GC_PINNED)) { 
+                    wref->obj = (Object*)(hdr->copy - ObjectHeader::GC_COPIED);
+                }
+            } else if (hdr->getSegment()->owner == this) {
+                if (!hdr->segment->isLargeObject() || !isLargeObjectMarked((LargeObjectSegment*)hdr->segment)) { 
+                    wref->obj = NULL;
+                }
             }
         }
-        // Copy phase is done
+        // Copy phase is done: pinned objects stay in their segments
+        liveObjectsSize = allocated + sweepLargeObjects();
+        for (Pin* pin = pinnedObjects; pin != NULL; pin = pin->next) { 
+            unpinObject(pin->obj);
+        }
+        for (size_t i = 0; i < nRemembered; i++) { 
+            unpinObject(remembered[i]);
+        }
+        free(remembered);
         
 
         // Now traverse list of old segments
+        size_t now = getCurrentTime();
         while (old != NULL) {
             size_t next = (size_t)old->next;
             if (next & MemorySegment::PINNED_SEGMENT) { // segment contains pinned objects, reclaim it
-                old->next = (MemorySegment*)((size_t)usedSegment | (next & MemorySegment::LARGE_SEGMENT));
-                usedSegment = old;
+                if (usedSegment == NULL) { // nothing was copied, so used == defaultSegmentSize and segment is not used for allocation
+                    old->next = (MemorySegment*)(next & MemorySegment::LARGE_SEGMENT);
+                    usedSegment = old;
+                } else { // insert it after the current segment: allocation continues in the current segment
+                    old->next = (MemorySegment*)(((size_t)usedSegment->next & ~MemorySegment::MASK) | (next & MemorySegment::LARGE_SEGMENT));
+                    usedSegment->next = (MemorySegment*)((size_t)old | ((size_t)usedSegment->next & MemorySegment::MASK));
+                }
             } else { 
                 if (next & MemorySegment::LARGE_SEGMENT) { 
-                    delete old;
+                    unmapSegment(old);
                 } else { 
                     old->next = freeSegment;
+                    old->freeTime = now;
                     freeSegment = old;
                 }
             }
             old = (MemorySegment*)(next & ~MemorySegment::MASK);
         }                
+        decayFreeSegments();
+        purgeOutgoing(); // objects of other heaps which references were not found by this GC may be reclaimed by their owners
         allocated = 0;
         autoStartThreshold = saveStartThreshold;
+        adjustThresholds();
+        adjustUsedLimit();
     }
 }
@@ -14,6 +14,23 @@ namespace GC
     class Root;
     class Pin;
 
+    /**
+     * Trace descriptor: list of reference fields (Ref<T> and WeakRef<T>) of the class.
+     * It defines clone() method which moves object to the new location by bitwise copy
+     * and then copies objects referenced by the listed fields, instead of invoking copy constructor of the class
+     * (which copies all other members and recursively copies referenced objects through Ref<T> copy constructor).
+     * So it can be used only for classes of fixed size which objects can be moved by memcpy 
+     * (do not contain pointers to their own members). Fields of base classes should be listed too:
+     *
+     *     GC_TRACE_BEGIN(Tree)
+     *         GC_TRACE(left)
+     *         GC_TRACE(right)
+     *     GC_TRACE_END
+     */
+    #define GC_TRACE_BEGIN(Class) virtual GC::Object* clone(GC::MemoryAllocator* gcAllocator) { \
+        Class* gcCopy = (Class*)gcAllocator->_move(this, sizeof(Class));
+    #define GC_TRACE(field) GC::trace(gcAllocator, gcCopy->field);
+    #define GC_TRACE_END return gcCopy; }
     
     /**
      * Memory allocation segment.
@@ -22,6 +39,8 @@ namespace GC
      * is larger than this size, then larger segment is created.
      * Unused segments are not deallocated, but linked in list to be reused in future.
      * But it is true only for segments of standard size: large segments are not reused.
+     * All segments are mapped from OS and free segments not reused during decay time are unmapped.
+     * Objects not smaller than large object threshold are placed in segments of large object space (see LargeObjectSegment).
      */
     struct MemorySegment
     {
@@ -29,10 +48,58 @@ namespace GC
         { 
             PINNED_SEGMENT = 1, // segment contains pinned object
             LARGE_SEGMENT  = 2, // segment of non-standard size
-            MASK = 3
+            LARGE_OBJECT   = 4, // segment of large object space
+            MASK = 7
         };   
         MemorySegment*   next;      // L1-list of segment | Bitmask
         MemoryAllocator* owner;     // owner is needed to distinguish self objects from "foreign" objects.
+        size_t           freeTime;  // time (msec) when segment was placed in the list of free segments
+        size_t           size;      // size of mapped region
+
+        bool isLargeObject() const { 
+            return ((size_t)next & LARGE_OBJECT) != 0;
+        }
+    };
+
+    /**
+     * Segment of large object space: region of virtual memory mapped from OS for the single large object.
+     * Large objects are never copied by GC: their references are updated in place and they are marked 
+     * in the side bitmap of allocator indexed by position of segment in allocator's table of large objects.
+     * Segments of unreachable large objects are unmapped at the end of GC.
+     */
+    struct LargeObjectSegment : MemorySegment
+    {
+        size_t index; // position in the table of large objects
+    };
+
+    /**
+     * Map of address space divided into chunks of OS page size to segments of all allocators.
+     * Segments are mapped from OS, so chunk never belongs to more than one segment.
+     * It is used by barrier to check whether reference is located in garbage collected heap and locate its allocator.
+     */
+    class SegmentMap
+    {
+        enum { 
+            CHUNK_BITS = 12, // log2 of OS page size
+            LEAF_BITS = 18,
+            ROOT_BITS = 18   // 48 bit address space is covered
+        };
+        static MemorySegment** volatile root[1 << ROOT_BITS];
+
+      public:
+        static MemorySegment* find(void const* addr) { 
+            size_t chunk = (size_t)addr >> CHUNK_BITS;
+            if ((chunk >> LEAF_BITS) >= ((size_t)1 << ROOT_BITS)) { 
+                return NULL;
+            }
+            MemorySegment** leaf = root[chunk >> LEAF_BITS];
+            return leaf != NULL ? leaf[chunk & ((1 << LEAF_BITS) - 1)] : NULL;
+        }
+
+        /**
+         * Associate all chunks of the segment with the specified value (segment itself or NULL)
+         */
+        static void set(MemorySegment* segment, MemorySegment* value);
     };
 
     /**
@@ -41,16 +108,84 @@ namespace GC
      */
     union ObjectHeader 
     { 
-        enum { GC_COPIED = 1 }; // mark set during GC
-        size_t copy; // pointer to object copy | GC_COPIED
+        enum { 
+            GC_COPIED = 1, // mark set during GC
+            GC_PINNED = 2  // object is not moved by GC: header keeps reference to its segment
+        };
+        size_t copy; // pointer to object copy | GC_COPIED or pointer to segment of pinned object | GC_PINNED (| GC_COPIED when it is traversed)
         MemorySegment* segment; // reference to segment is needed to distinguish self objects from "foreign" objects.
         double  align; // just for alignment of header
+
+        /**
+         * Segment of the object which is not forwarded (header of pinned object keeps GC flags)
+         */
+        MemorySegment* getSegment() const { 
+            return (MemorySegment*)(copy & ~(size_t)(GC_COPIED|GC_PINNED));
+        }
     };    
 
+    /**
+     * Cross-heap remembered set: hash table of objects of the allocator referenced from heaps of other allocators.
+     * Objects of the set are pinned by GC of their owner, because references located in other heaps can not be updated by it.
+     * Each entry is stamped with epoch (sequence number of GC) of the allocator which heap contains the reference: 
+     * entries not confirmed by the GC of that allocator are removed.
+     */
+    class RememberedSet
+    {
+      public:
+        struct Entry
+        {
+            Object* obj;             // referenced object (NULL for free position of the table)
+            MemoryAllocator* source; // allocator which heap contains the reference
+            size_t epoch;            // epoch of the source in which reference was found
+        };
+
+        /**
+         * Add entry or update epoch of existing entry
+         */
+        void add(Object* obj, MemoryAllocator* source, size_t epoch);
+
+        /**
+         * Remove entries of the source found before the specified epoch. 
+         * Entries stored by barriers since the previous purge are stamped with this epoch: the next GC of the source should confirm them.
+         */
+        void purge(MemoryAllocator* source, size_t epoch);
+
+        /**
+         * Remove entries of the source with epoch below the specified one ((size_t)-1 - all entries of the source)
+         */
+        void remove(MemoryAllocator* source, size_t epoch);
+
+        /**
+         * Size of hash table (entries are enumerated by at())
+         */
+        size_t capacity() const { 
+            return allocated;
+        }
+
+        /**
+         * Get entry at the specified position of hash table
+         */
+        Entry const& at(size_t pos) const { 
+            return table[pos];
+        }
+
+        RememberedSet();
+        ~RememberedSet();
+
+      private:
+        Entry* table;
+        size_t used;
+        size_t allocated;
+    };
+
     /**
      * Memory allocator class with implicit memory deallocation (garbage collector). 
      * Each thread should have its own allocator. So each thread is allocating and deallocating only its own objects.
-     * But it is possible to refer object created by some global allocator, taken in account that this objects will not be protected from GC.
+     * But it is possible to refer object created by other allocator: objects stored in references located in heap of this allocator
+     * and objects found by its GC are included in remembered set of their owner, 
+     * which doesn't reclaim or move them until GC of this allocator finds that they are not referenced any more.
+     * Objects referenced only from other threads' Var<T> variables and cycles of references between heaps are not protected in this way.
      */
     class MemoryAllocator
     {
@@ -59,19 +194,30 @@ namespace GC
         /**
          * Get allocator for the current thread. Each thread should have its own allocator.
          */
-        static MemoryAllocator* getCurrent();
+        static MemoryAllocator* getCurrent() { 
+            MemoryAllocator* allocator = ctx.get();
+            assert(allocator != NULL);
+            return allocator;
+        }
 
         /**
          * Allocate object 
          * @param object size
          */
-        static Object* allocate(size_t size);
+        static Object* allocate(size_t size) { 
+            return getCurrent()->_allocate(size);
+        }
 
         /**
          * Total size of allocated objects
          */
         static size_t totalAllocated();
 
+        /**
+         * Total size of objects (including headers) copied by the last GC and of large objects found alive by it
+         */
+        static size_t liveSize();
+
         /**
          * Visit weak reference. Garbage collector links all weak references in list and after mark phase reset 
          * those of them non pointing to live objects.
@@ -83,12 +229,16 @@ namespace GC
         /**
          * Register root object. Registering root protects it and all referenced objects from GC.
          */
-        static void registerRoot(Root* root);
+        static void registerRoot(Root* root) { 
+            getCurrent()->_registerRoot(root);
+        }
             
         /**
          * Unregister root object. Make this object tree available for GC.
          */
-        static void unregisterRoot(Root* root);
+        static void unregisterRoot(Root* root) { 
+            getCurrent()->_unregisterRoot(root);
+        }
 
         /**
          * Pin object. Protect it from deallocation and copying by GC.
@@ -101,7 +251,9 @@ namespace GC
         static void unregisterPin(Pin* pin);
 
         /**
-         * Deep copy
+         * Deep copy. Objects of large object space (see setLargeObjectThreshold) are not copied by clone() defined 
+         * with GC_TRACE: their references are updated in place, so the copy shares them with the original.
+         * Custom clone() allocating new instance of large object moves it as any other object.
          * @param obj cloned object
          * @return cloned object 
          */
@@ -116,7 +268,38 @@ namespace GC
          * Start garbage collection if number of allocated objects since last GC exceeds StartThreshold 
          */
         static void allowGC();
-        
+
+        /**
+         * Return all free segments to OS regardless of decay time (see setMemoryDecay)
+         */
+        static void releaseMemory();
+
+        /**
+         * Barrier used by references to maintain cross-heap remembered sets: if object of one allocator is stored 
+         * in reference located in heap of other allocator, it is added to the remembered set of its owner 
+         * and so is neither moved nor reclaimed by GC of the owner until GC of the other allocator finds that reference is not alive any more.
+         * It is no-op if there is only one allocator.
+         * @param field address of updated reference
+         * @param obj stored object (may be NULL)
+         */
+        static void rememberForeign(void const* field, Object const* obj) { 
+            if (nAllocators > 1 && obj != NULL) { 
+                rememberReference(field, obj);
+            }
+        }
+
+        /**
+         * Barrier used by constructors of references: it is the same as rememberForeign(), but location of the reference is checked inline,
+         * so construction of references outside heap (local variables and temporaries) doesn't call rememberReference()
+         * @param field address of initialized reference
+         * @param obj stored object (may be NULL)
+         */
+        static void rememberInitialized(void const* field, Object const* obj) { 
+            if (nAllocators > 1 && obj != NULL && SegmentMap::find(field) != NULL) { 
+                rememberReference(field, obj);
+            }
+        }
+
         /**
          * Create instance of memory allocator 
          * @param segmentSize default size of memory allocation segment
@@ -127,6 +310,32 @@ namespace GC
          */
         MemoryAllocator(size_t segmentSize = 1024*1024, size_t gcStartThreshold = 1024*1024, size_t gcAutoStartThreshold = (size_t)-1);
 
+        /**
+         * Set size of objects placed in the large object space. Such objects get their own region of memory mapped from OS,
+         * are never copied by GC (clone() method of large object should update its references in place, as GC_TRACE_BEGIN does) 
+         * and are unmapped when GC finds them unreachable.
+         * By default objects not fitting in the segment of default size are placed in the large object space.
+         * @param threshold minimal size of object allocated in the large object space
+         */
+        void setLargeObjectThreshold(size_t threshold);
+
+        /**
+         * Set decay time of free memory. Segments released by GC are kept in the list of free segments for reuse.
+         * Segments which are not reused during decay time are returned to OS: expired segments are released at the end of GC
+         * or explicitly by releaseMemory(), so memory taken during peak load is given back after it.
+         * @param decayTime time in milliseconds (0 - return free segments to OS immediately, (size_t)-1 - never return them)
+         */
+        void setMemoryDecay(size_t decayTime);
+
+        /**
+         * Set threshold of allowGC() to growthPercent percents of the size of objects copied by the last GC, 
+         * bounded by minThreshold and maxThreshold. Threshold of automatic GC start is scaled in the same proportion.
+         * @param growthPercent percents of live size allocated before next GC (0 - disable adaptive threshold)
+         * @param minThreshold lower bound of the threshold
+         * @param maxThreshold upper bound of the threshold
+         */
+        void setAdaptiveThreshold(size_t growthPercent, size_t minThreshold = 1024*1024, size_t maxThreshold = (size_t)-1);
+
         /**
          * Deallocate all objects create by GC.
          */
@@ -147,35 +356,93 @@ namespace GC
          */
         void _copy(Object** refs, size_t nRefs);
 
+        /**
+         * Bitwise copy of the object being cloned by GC (used by GC_TRACE_BEGIN)
+         * @param obj cloned object
+         * @param size object size
+         * @return new location of the object or the object itself if it is pinned or large
+         */
+        Object* _move(Object* obj, size_t size);
+
 
         // internal instance methods
         void  _registerRoot(Root* root);     
         void  _unregisterRoot(Root* root);        
         void  _registerPin(Pin* pin);     
         void  _unregisterPin(Pin* pin);        
-        Object* _allocate(size_t size);
+        /**
+         * Inline fast path of allocation: bump pointer in the current segment.
+         * Segment refill, large objects, cloning and automatic start of GC are handled by allocateSlow().
+         */
+        Object* _allocate(size_t size) {
+            size = (size + sizeof(ObjectHeader) + 7) & ~7; // align on 8
+            if (size < largeObjectThreshold && used + size <= usedLimit) { 
+                ObjectHeader* hdr = (ObjectHeader*)((char*)(usedSegment + 1) + used);
+                used += size;
+                allocated += size;
+                hdr->segment = usedSegment;
+                return (Object*)(hdr + 1);
+            }
+            return allocateSlow(size);
+        }
         void  _gc();
         void  _allowGC();
+        void  _releaseMemory();
         void _visit(AnyWeakRef* wref);
         size_t _totalAllocated() const { 
             return used;
         }
+        size_t _liveSize() const { 
+            return liveObjectsSize;
+        }
 
 
       private:
+        static void rememberReference(void const* field, Object const* obj);
+        void rememberIncoming(Object* obj, MemoryAllocator* source, size_t epoch);
+        void purgeOutgoing();
+        void pinObject(Object* obj);
+        void unpinObject(Object* obj);
+        Object* allocateSlow(size_t size);
+        ObjectHeader* allocateLarge(size_t size);
+        void adjustUsedLimit();
+        bool markLargeObject(LargeObjectSegment* segment);
+        bool isLargeObjectMarked(LargeObjectSegment* segment) const;
+        size_t sweepLargeObjects();
+        void adjustThresholds();
+        void releaseFreeSegments(size_t releaseTime);
+        void decayFreeSegments();
+
         size_t  defaultSegmentSize;
         size_t  used;               // Size used in the current segment
-        MemorySegment* freeSegment; // L1 list of free segments
+        size_t  usedLimit;          // Value of 'used' up to which objects can be allocated by inline fast path (0 disables fast path)
+        MemorySegment* freeSegment; // L1 list of free segments (most recently released first)
+        size_t  memoryDecay;        // time (msec) after which free segment is returned to OS
         MemorySegment* usedSegment; // L1 list of used segments
         size_t  allocated;          // Total allocated since last GC
         Root*   roots;              // Object roots
         Pin*    pinnedObjects;      // Pinned objects
         size_t  startThreshold;     // Total size of allocated objects since last GC after which allocGC() method start garbage collection
         size_t  autoStartThreshold; // Total size of allocated objects since last GC after GC is automatically started
+        size_t  liveObjectsSize;    // Size of objects copied by the last GC and live large objects
+        size_t  growthPercent, minThreshold, maxThreshold; // Parameters of setAdaptiveThreshold()
+        size_t  autoStartPercent;   // autoStartThreshold in percents of startThreshold
         Object* clonedObject;       // Not null and points to original object when object is cloned during GC
         AnyWeakRef* weakReferences; // L1-list of weak references constructed during mark phase
+        size_t  largeObjectThreshold; // Minimal size of object allocated in large object space
+        LargeObjectSegment** largeObjects; // Table of segments of large object space
+        size_t* largeObjectMarks;   // Mark bitmap of large objects indexed by position in the table
+        size_t  nLargeObjects;      // Number of large objects
+        size_t  maxLargeObjects;    // Allocated size of the table of large objects
+        RememberedSet incoming;     // Objects of this allocator referenced from heaps of other allocators
+        Mutex   incomingMutex;      // Protects remembered set which is updated by other threads
+        size_t  epoch;              // Sequence number of GC: references to foreign objects found by it are stamped with it
+        MemoryAllocator* nextAllocator; // Next allocator in the list of all allocators
 
         static ThreadContext<MemoryAllocator> ctx; // Context to locate current memory allocator
+        static size_t volatile nAllocators; // Number of existing allocators (cross-heap references are possible if there are more than one)
+        static MemoryAllocator* allocators; // L1 list of all allocators
+        static Mutex allocatorsMutex; // Protects list of allocators
     };
 
     /**
@@ -269,7 +536,9 @@ namespace GC
             return obj;
         }
         T* operator = (T const* val) {
-            return obj = (T*)val;            
+            obj = (T*)val;
+            MemoryAllocator::rememberForeign(this, obj);
+            return obj;
         }
         bool operator == (T const* other) { 
             return obj == other;
@@ -284,7 +553,9 @@ namespace GC
             return obj != other.obj;
         }
         
-        Ref(T const* ptr = NULL) : obj((T*)ptr) {}
+        Ref(T const* ptr = NULL) : obj((T*)ptr) {
+            MemoryAllocator::rememberInitialized(this, obj); // reference may be initialized by constructor of object of other heap
+        }
 
         /**
          * Copy constructor performs deep copy of referenced objects using current allocator (if any)
@@ -292,7 +563,11 @@ namespace GC
         Ref(Ref<T>& ref) 
         {
             obj = ref.obj = (T*)MemoryAllocator::copy(ref.obj); // we need to update original copy for pinned objects
+            MemoryAllocator::rememberInitialized(this, obj);
         }
+
+        template<class U>
+        friend void trace(MemoryAllocator* allocator, Ref<U>& ref);
     };
 
     /**
@@ -342,7 +617,8 @@ namespace GC
             return (T*)obj;
         }
         T* operator = (T const* val) {
-            return obj = (Object*)val;            
+            obj = (Object*)val;
+            return (T*)val;
         }
         bool operator == (T const* other) { 
             return obj == other;
@@ -360,6 +636,23 @@ namespace GC
         WeakRef(T const* ptr = NULL) : AnyWeakRef(ptr) {}
     };
 
+    /**
+     * Copy object referenced by strong reference field and update the field (used by GC_TRACE)
+     */
+    template<class T>
+    inline void trace(MemoryAllocator* allocator, Ref<T>& ref) 
+    { 
+        ref.obj = (T*)allocator->_copy(ref.obj); // references found by GC are remembered by _copy() itself
+    }
+
+    /**
+     * Register weak reference field (used by GC_TRACE)
+     */
+    inline void trace(MemoryAllocator* allocator, AnyWeakRef& wref) 
+    { 
+        allocator->_visit(&wref);
+    }
+
     /**
      * Base class for variables referencing objects and protecting them from GC.
      */
@@ -425,8 +718,7 @@ namespace GC
             return obj;
         }
         T* operator = (T const* val) {
-            obj = (T*)val;
-            return val;
+            return obj = (T*)val;
         }
         bool operator == (T const* other) { 
             return obj == other;
@@ -21,6 +21,10 @@ namespace GC
         static ScalarArray* create(size_t len) { 
             return new ((len-1)*sizeof(T)) ScalarArray(len);
         }
+
+        static ScalarArray* create(size_t len, MemoryAllocator* allocator) { 
+            return new ((len-1)*sizeof(T), allocator) ScalarArray(len);
+        }
         
         T& operator[](size_t index) { 
             assert(index < length);
@@ -52,9 +56,7 @@ namespace GC
 
         Object* clone(MemoryAllocator* allocator) 
         { 
-            ScalarArray* copy = new ((length-1)*sizeof(T), allocator) ScalarArray(length);
-            memcpy(copy->body, body, length*sizeof(T));
-            return copy;
+            return allocator->_move(this, sizeof(ScalarArray) + (length-1)*sizeof(T));
         }
     };
 
@@ -71,10 +73,42 @@ namespace GC
         static ObjectArray* create(size_t len) { 
             return new ((len-1)*sizeof(T*)) ObjectArray(len);
         }
+
+        static ObjectArray* create(size_t len, MemoryAllocator* allocator) { 
+            return new ((len-1)*sizeof(T*), allocator) ObjectArray(len);
+        }
         
-        T*& operator[](size_t index) { 
+        /**
+         * Element of the array returned by operator[]: assignment to it is performed by set()
+         */
+        class Element
+        {
+            ObjectArray* array;
+            size_t index;
+
+          public:
+            T* operator = (T const* obj) { 
+                array->set(index, obj);
+                return (T*)obj;
+            }
+            T* operator = (Element const& other) { 
+                T* obj = other;
+                array->set(index, obj);
+                return obj;
+            }
+            T* operator->() const { 
+                return array->body[index];
+            }
+            operator T*() const { 
+                return array->body[index];
+            }
+
+            Element(ObjectArray* a, size_t i) : array(a), index(i) {}
+        };
+
+        Element operator[](size_t index) { 
             assert(index < length);
-            return body[index];
+            return Element(this, index);
         }
 
         T* operator[](size_t index) const{ 
@@ -82,6 +116,15 @@ namespace GC
             return body[index];
         }
 
+        /**
+         * Store object in the element of the array passing it through write barrier
+         */
+        void set(size_t index, T const* obj) { 
+            assert(index < length);
+            body[index] = (T*)obj;
+            MemoryAllocator::rememberForeign(&body[index], obj);
+        }
+
         size_t size() const { 
             return length;
         }
@@ -102,8 +145,7 @@ namespace GC
 
         Object* clone(MemoryAllocator* allocator) 
         { 
-            ObjectArray* copy = new ((length-1)*sizeof(T*), allocator) ObjectArray(*this);
-            memcpy(copy->body, body, length*sizeof(T*));
+            ObjectArray* copy = (ObjectArray*)allocator->_move(this, sizeof(ObjectArray) + (length-1)*sizeof(T*));
             allocator->_copy((Object**)copy->body, length);
             return copy;
         }        
@@ -119,10 +161,9 @@ namespace GC
         GC::Ref< ScalarArray<T> > body;
         size_t length;
         
-        Object* clone(MemoryAllocator* allocator) 
-        { 
-            return new (allocator) ScalarVector(*this);
-        }
+        GC_TRACE_BEGIN(ScalarVector)
+            GC_TRACE(body)
+        GC_TRACE_END
 
       public:
         ScalarVector(size_t reserve = 8) { 
@@ -191,10 +232,9 @@ namespace GC
         GC::Ref< ObjectArray<T> > body;
         size_t length;
         
-        Object* clone(MemoryAllocator* allocator) 
-        { 
-            return new (allocator) ObjectVector(*this);
-        }
+        GC_TRACE_BEGIN(ObjectVector)
+            GC_TRACE(body)
+        GC_TRACE_END
 
       public:
         ObjectVector(size_t reserve = 8) { 
@@ -231,7 +271,7 @@ namespace GC
             return (*body)[length-1];
         }
             
-        T*& operator[](size_t index) { 
+        typename ObjectArray<T>::Element operator[](size_t index) { 
             assert(index < length);
             return (*body)[index];
         }
@@ -275,6 +315,18 @@ namespace GC
             return new (len) String(str, len);
         }
 
+        static String* create(size_t len, MemoryAllocator* allocator) { 
+            return new (len, allocator) String(len);
+        }
+
+        static String* create(char const* str, MemoryAllocator* allocator) { 
+            return create(str, strlen(str), allocator);
+        }
+
+        static String* create(char const* str, size_t len, MemoryAllocator* allocator) {
+            return new (len, allocator) String(str, len);
+        }
+
         int compare(char const* other) { 
             return strcmp(body, other);
         }
@@ -305,7 +357,7 @@ namespace GC
 
       protected:
         Object* clone(MemoryAllocator* allocator) { 
-            return new (length, allocator) String(body, length);
+            return allocator->_move(this, sizeof(String) + length);
         }
         
         String(char const* str, size_t len) { 
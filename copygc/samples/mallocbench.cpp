@@ -204,5 +204,15 @@ int main() {
         }
     }
     printf("Elapsed time for copy allocator: %ld\n", time(NULL) - start);
+    {
+        GC::MemoryAllocator mem(1*Mb, 1*Mb, 1*Mb);
+        mem.setAdaptiveThreshold(800); // live objects are copied once per 8 times their size allocated
+        GC::ArrayVar<GCObject,liveObjects> objectRefs;
+        start = time(NULL);
+        for (size_t i = 0; i < totalObjects; i++) { 
+            objectRefs[i % liveObjects] = new GCObject();
+        }
+    }
+    printf("Elapsed time for copy allocator with adaptive threshold: %ld\n", time(NULL) - start);
     return 0;
 }
@@ -22,9 +22,11 @@ class Tree : public GC::Object
     }
 
   protected:
-    virtual GC::Object* clone(GC::MemoryAllocator* allocator) { 
-        return new (allocator) Tree(*this); 
-    }
+    GC_TRACE_BEGIN(Tree)
+        GC_TRACE(label)
+        GC_TRACE(left)
+        GC_TRACE(right)
+    GC_TRACE_END
 
     bool check(size_t& nNodes, size_t level, size_t height) {
         char buf[16];
@@ -51,7 +53,126 @@ class Tree : public GC::Object
 };
 
 typedef GC::ObjectArray<Tree> Wood;
+
+const size_t foreignHeight = 10;
+
+struct ForeignTest
+{
+    GC::Mutex mutex;
+    GC::Event event;
+    Tree* tree;
+    int step;
+    size_t ownerLiveSize;
+    size_t collectedLiveSize;
+};
+
+static void setStep(ForeignTest* test, int step)
+{
+    GC::CriticalSection cs(test->mutex);
+    test->step = step;
+    test->event.signal();
+}
+
+static void waitStep(ForeignTest* test, int step)
+{
+    GC::CriticalSection cs(test->mutex);
+    while (test->step < step) { 
+        test->event.wait(test->mutex);
+    }
+}
+
+static void collectForeignOwner(GC::MemoryAllocator& mem)
+{
+    for (int i = 0; i < 3; i++) { 
+        mem.gc();
+        for (int j = 0; j < 16; j++) { // garbage exceeding segment size reuses segments released by GC
+            (void)Tree::build(foreignHeight + 1); // layout differs from the checked tree
+        }
+    }
+}
+
+static void ownForeignTree(void* arg)
+{
+    ForeignTest* test = (ForeignTest*)arg;
+    GC::MemoryAllocator mem(1*Mb, 1*Mb, -1);
+    GC::Var<Tree> tree = Tree::build(foreignHeight);
+    test->tree = tree;
+    setStep(test, 1);
+    waitStep(test, 2); // tree is stored in heap of the main thread
+    tree = NULL;
+    collectForeignOwner(mem); // reference is not yet confirmed by GC of the main thread
+    setStep(test, 3);
+    waitStep(test, 4);
+    collectForeignOwner(mem); // reference is confirmed by GC of the main thread
+    test->ownerLiveSize = GC::MemoryAllocator::liveSize();
+    setStep(test, 5);
+    waitStep(test, 6); // reference is cleared and GC of the main thread has not found it
+    mem.gc();
+    test->collectedLiveSize = GC::MemoryAllocator::liveSize();
+}
+
+static bool checkForeignReference(GC::MemoryAllocator& mem)
+{
+    ForeignTest test;
+    GC::Thread owner;
+    test.step = 0;
+    if (!owner.start(ownForeignTree, &test)) { 
+        fprintf(stderr, "Failed to start thread\n");
+        return false;
+    }
+    GC::Var<Wood> holder = Wood::create(1);
+    waitStep(&test, 1);
+    Tree* location = test.tree;
+    (*holder)[0] = location;
+    setStep(&test, 2);
+    waitStep(&test, 3);
+    bool ok = (*holder)[0] == location && Tree::check(location, foreignHeight);
+    mem.gc();
+    setStep(&test, 4);
+    waitStep(&test, 5);
+    ok = ok && (*holder)[0] == location && Tree::check(location, foreignHeight);
+    (*holder)[0] = NULL;
+    mem.gc();
+    setStep(&test, 6);
+    owner.join();
+    if (!ok) { 
+        fprintf(stderr, "Object referenced only from other heap is moved or reclaimed by GC of its owner\n");
+        return false;
+    }
+    if (test.collectedLiveSize >= test.ownerLiveSize) { 
+        fprintf(stderr, "Object is not reclaimed after reference from other heap is cleared\n");
+        return false;
+    }
+    return true;
+}
     
+static void storeForeignTree(void* arg)
+{
+    GC::MemoryAllocator mem(1*Mb, 1*Mb, -1);
+    GC::Var<Wood> holder = Wood::create(1);
+    (*holder)[0] = (Tree*)arg; // allocator is destroyed before its GC confirms the reference
+}
+
+static bool checkDestroyedSource(GC::MemoryAllocator& mem)
+{
+    GC::Var<Tree> tree = Tree::build(foreignHeight);
+    GC::Thread source;
+    if (!source.start(storeForeignTree, (Tree*)tree)) { 
+        fprintf(stderr, "Failed to start thread\n");
+        return false;
+    }
+    source.join();
+    mem.gc();
+    size_t liveSize = GC::MemoryAllocator::liveSize();
+    tree = NULL;
+    mem.gc();
+    if (GC::MemoryAllocator::liveSize() >= liveSize) { 
+        fprintf(stderr, "Object referenced from destroyed heap is not reclaimed\n");
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[]) 
 { 
     int nTrees = argc > 1 ? atoi(argv[1]) : 100;
@@ -71,6 +192,35 @@ int main(int argc, char* argv[])
             }
             mem.allowGC();
         }
+        const int nIterations = 10;
+        clock_t gcStart = clock();
+        for (int i = 0; i < nIterations; i++) { 
+            mem.gc();
+        }
+        printf("GC time %.1f msec\n", (double)(clock() - gcStart)*1000/CLOCKS_PER_SEC/nIterations);
+        for (int tree = 0; tree < nTrees; tree++) { 
+            if (!Tree::check((*wood)[tree], maxHeight-1)) { 
+                fprintf(stderr, "Check failed after GC for tree=%d\n", tree);
+                return EXIT_FAILURE;
+            } 
+        }
+        // Pinned object is neither moved by GC nor overwritten by objects allocated after it
+        GC::Var<Tree> pinned = Tree::build(10);
+        Tree* location = pinned;
+        { 
+            GC::Pin pin(pinned);
+            for (int i = 0; i < nIterations; i++) { 
+                mem.gc();
+                (void)Tree::build(10);
+            }
+            if ((Tree*)pinned != location || !Tree::check(pinned, 10)) { 
+                fprintf(stderr, "Check failed for pinned tree\n");
+                return EXIT_FAILURE;
+            }
+        }
+        if (!checkForeignReference(mem) || !checkDestroyedSource(mem)) { 
+            return EXIT_FAILURE;
+        }
     }
     printf("Elapsed time %d\n", (int)(time(NULL) - start));
     return EXIT_SUCCESS;
@@ -2,8 +2,39 @@
 #define __THREADCTX_H__
 
 
+#if defined(_MSC_VER)
+#define GC_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define GC_THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+#endif
+
 namespace GC
 {
+#ifdef GC_THREAD_LOCAL
+    /**
+     * Class implementing thread local (thread specific in terms of Posix) memory.
+     * Value is stored in static thread local variable (initial-exec TLS model) accessed without function call, 
+     * so there should be single context for each type T.
+     */
+    template<class T>
+    class ThreadContext 
+    {
+      public:
+        T* get() { 
+            return value;
+        }
+
+        void set(T* val) { 
+            value = val;
+        }
+
+      private:
+        static GC_THREAD_LOCAL T* value;
+    };
+
+    template<class T>
+    GC_THREAD_LOCAL T* ThreadContext<T>::value;
+#else
     class ThreadContextImpl 
     {
       public:
@@ -19,7 +50,8 @@ namespace GC
     };
 
     /**
-     * Class implementing thread local (thread specific in terms of Posix) memory
+     * Class implementing thread local (thread specific in terms of Posix) memory.
+     * Compiler doesn't support thread local variables, so value is accessed through key allocated by the context.
      */
     template<class T>
     class ThreadContext : public ThreadContextImpl 
@@ -29,6 +61,90 @@ namespace GC
             return (T*)ThreadContextImpl::get();
         }
     };
+#endif
+
+    /**
+     * Mutual exclusion lock
+     */
+    class Mutex 
+    {
+        friend class Event;
+      public:
+        void lock();
+        void unlock();
+
+        Mutex();
+        ~Mutex();
+
+      private:
+        void* impl;
+    };
+
+    /**
+     * Guard locking mutex in constructor and unlocking it in destructor
+     */
+    class CriticalSection 
+    {
+        Mutex& mutex;
+      public:
+        CriticalSection(Mutex& m) : mutex(m) { 
+            mutex.lock();
+        }
+        ~CriticalSection() { 
+            mutex.unlock();
+        }
+    };
+
+    /**
+     * Condition variable 
+     */
+    class Event 
+    {
+      public:
+        /**
+         * Wait until event is signaled. Mutex should be locked by the caller.
+         */
+        void wait(Mutex& mutex);
+
+        /**
+         * Wake up all waiting threads
+         */
+        void signal();
+
+        Event();
+        ~Event();
+
+      private:
+        void* impl;
+    };
+
+    /**
+     * Thread executing specified procedure
+     */
+    class Thread 
+    {
+      public:
+        typedef void (*Procedure)(void* arg);
+
+        /**
+         * Start thread 
+         * @param proc procedure executed by thread
+         * @param arg procedure argument
+         * @return true if thread is successfully started
+         */
+        bool start(Procedure proc, void* arg);
+
+        /**
+         * Wait thread termination
+         */
+        void join();
+
+        Thread();
+        ~Thread();
+
+      private:
+        void* impl;
+    };
 };
 
 #endif
@@ -1,23 +1,582 @@
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <time.h>
+#endif
 #include "gc.h"
 
 namespace GC 
 { 
-    const size_t BLACK_MARK = 1;
+    const size_t FREE_SLOT = ObjectHeader::FREE_SLOT;
+    const size_t FINALIZATION_PENDING = ObjectHeader::FINALIZATION_PENDING;
+    const size_t INIT_MARK_STACK_SIZE = 1024; 
+    const size_t MAX_MARK_STACK_SIZE = 1024*1024;
+    const size_t BITS_PER_WORD = sizeof(size_t)*8;
+    
+    const size_t ROOT_BATCH = 16; // number of roots taken by mark thread at once
+    const size_t PREFETCH_BATCH = 16; // number of array elements which mark bits are prefetched at once
+    const size_t PREFETCH_DISTANCE = 8; // grey object is prefetched when it is at this depth in the mark stack
+    const size_t INIT_ROOT_STACK_SIZE = 1024;
+    const size_t INIT_REMEMBERED_SET_SIZE = 64;
+    const size_t UNCONFIRMED_EPOCH = (size_t)-2; // epoch of cross-heap reference stored by barrier: it is above epoch of any mark phase
+    const size_t DEFAULT_LARGE_OBJECT_THRESHOLD = 256*1024;
+    const size_t DEFAULT_MEMORY_DECAY = 10*1000; // msec
+    const size_t PAGES_PER_CHUNK = 64; // standard pages are mapped from OS in chunks of 4Mb
+    const size_t MAX_CACHED_PAGES = 1024; // limit of empty pages cached by allocator (64Mb)
+    const size_t N_CLASSES = MemoryPage::N_SIZE_CLASSES*2; // size classes of objects with references followed by pointer-free size classes
+    const size_t FIRST_LINE = (sizeof(MemoryPage) + MemoryPage::LINE_SIZE - 1) / MemoryPage::LINE_SIZE; // first line of block not overlapped with page header
     
     ThreadContext<MemoryAllocator> MemoryAllocator::ctx;
+    ThreadContext<MarkStack> MemoryAllocator::markStackCtx;
+    size_t volatile MemoryAllocator::nIncrementalMarkers;
+    size_t volatile MemoryAllocator::nTracingAllocators;
+    size_t volatile MemoryAllocator::nGenerationalAllocators;
+    size_t volatile MemoryAllocator::nAllocators;
+    MemoryAllocator* MemoryAllocator::allocators;
+    Mutex MemoryAllocator::allocatorsMutex;
+
+    static AnyWeakRef* const LAST_WEAK_REF = (AnyWeakRef*)1; // terminator of list of registered weak references
+
+    /**
+     * Helper thread participating in parallel marking
+     */
+    struct MarkWorker 
+    { 
+        MemoryAllocator* allocator;
+        MarkStack stack;
+        Thread thread;
+    };
+
+    /**
+     * Hint processor to load cache line containing the specified address
+     */
+    static inline void prefetch(void const* addr)
+    {
+#if defined(__GNUC__)
+        __builtin_prefetch(addr);
+#elif defined(_WIN32)
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, addr);
+#endif
+    }
+
+    /**
+     * Prefetch word of page bitmap containing mark bit of the object
+     */
+    static inline void prefetchMarkBit(Object const* obj)
+    {
+        size_t bit = MemoryPage::getBitIndex(obj);
+        prefetch(&MemoryPage::getPage(obj)->markBits[bit / (sizeof(size_t)*8)]);
+    }
+
+    /**
+     * Prepend unreachable object to the list of objects waiting for finalization
+     */
+    static inline void addPending(ObjectHeader*& first, ObjectHeader*& last, ObjectHeader* hdr)
+    {
+        hdr->next = (ObjectHeader*)((size_t)first | FINALIZATION_PENDING);
+        first = hdr;
+        if (last == NULL) { 
+            last = hdr;
+        }
+    }
+
+    /**
+     * Check whether objects of the page can be moved by compaction of the specified allocator
+     */
+    static inline bool isMovable(MemoryPage const* page, MemoryAllocator const* allocator)
+    {
+        return page->owner == allocator && !page->region && page->slotSize <= MemoryPage::MAX_SMALL_SIZE;
+    }
+
+    static inline size_t popcount(size_t word)
+    {
+#ifdef __GNUC__
+        return __builtin_popcountl(word);
+#else
+        size_t n = 0;
+        while (word != 0) { 
+            word &= word - 1;
+            n += 1;
+        }
+        return n;
+#endif
+    }
+
+    /**
+     * Atomically replace value of the word
+     * @return old value of the word
+     */
+    static inline size_t atomicExchange(size_t volatile* word, size_t value)
+    {
+#ifdef _WIN32
+        return (size_t)InterlockedExchange64((LONG64 volatile*)word, (LONG64)value);
+#else
+        return __sync_lock_test_and_set(word, value);
+#endif
+    }
+
+    /**
+     * Atomically replace pointer if it has expected value
+     * @return true if pointer is replaced
+     */
+    static inline bool atomicCompareAndSwap(void* volatile* ptr, void* expected, void* value)
+    {
+#ifdef _WIN32
+        return InterlockedCompareExchangePointer(ptr, value, expected) == expected;
+#else
+        return __sync_bool_compare_and_swap(ptr, expected, value);
+#endif
+    }
+
+    MemoryPage** volatile PageMap::root[1 << PageMap::ROOT_BITS];
+
+    void PageMap::set(MemoryPage* page, MemoryPage* value)
+    {
+        for (size_t offs = 0; offs < page->pageSize; offs += MemoryPage::PAGE_SIZE) { 
+            size_t chunk = ((size_t)page + offs) >> CHUNK_BITS;
+            if ((chunk >> LEAF_BITS) >= ((size_t)1 << ROOT_BITS)) { 
+                return;
+            }
+            MemoryPage** volatile* leafRef = &root[chunk >> LEAF_BITS];
+            if (*leafRef == NULL) { 
+                if (value == NULL) { 
+                    return;
+                }
+                MemoryPage** leaf = (MemoryPage**)calloc(1 << LEAF_BITS, sizeof(MemoryPage*));
+                if (leaf == NULL) { 
+                    return;
+                }
+                if (!atomicCompareAndSwap((void* volatile*)leafRef, NULL, leaf)) { // leaf was concurrently created by other thread
+                    free(leaf);
+                }
+            }
+            (*leafRef)[chunk & ((1 << LEAF_BITS) - 1)] = value;
+        }
+    }
+
+    /**
+     * Slot sizes (including object header) of size classes
+     */
+    static const size_t sizeClasses[MemoryPage::N_SIZE_CLASSES] = { 
+        16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 
+        640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192
+    };
+
+    /**
+     * Map of slot size (in 16 bytes units) to size class
+     */
+    static struct SizeClassMap 
+    { 
+        unsigned char index[MemoryPage::MAX_SMALL_SIZE/16 + 1];
+
+        SizeClassMap() { 
+            size_t sc = 0;
+            for (size_t i = 0; i <= MemoryPage::MAX_SMALL_SIZE/16; i++) { 
+                if (i*16 > sizeClasses[sc]) { 
+                    sc += 1;
+                }
+                index[i] = (unsigned char)sc;
+            }
+        }
+    } sizeClassMap;
+
+    /**
+     * Map region of virtual memory from OS aligned on PAGE_SIZE boundary
+     */
+    static MemoryPage* mapPage(size_t pageSize)
+    {
+#ifdef _WIN32
+        return (MemoryPage*)VirtualAlloc(NULL, pageSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE); // allocation granularity is 64Kb
+#else
+        size_t alignment = MemoryPage::PAGE_SIZE;
+        char* base = (char*)mmap(NULL, pageSize + alignment, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (base == (char*)MAP_FAILED) { 
+            return NULL;
+        }
+        // Unmap unaligned head and tail of the region
+        char* page = (char*)(((size_t)base + alignment - 1) & ~(alignment - 1));
+        if (page != base) { 
+            munmap(base, page - base);
+        }
+        if (page != base + alignment) { 
+            munmap(page + pageSize, base + alignment - page);
+        }
+        return (MemoryPage*)page;
+#endif
+    }
+
+    /**
+     * Return region of virtual memory to OS
+     */
+    static void unmapPage(MemoryPage* page, size_t pageSize)
+    {
+#ifdef _WIN32
+        VirtualFree(page, 0, MEM_RELEASE);
+#else
+        munmap(page, pageSize);
+#endif
+    }
+
+    /**
+     * Pool of standard pages shared by all allocators (pages may be transferred between allocators by parcels).
+     * Pages are carved from chunks of PAGES_PER_CHUNK pages mapped from OS by a single call. 
+     * Released pages are decommitted, so their physical memory is returned to OS, 
+     * while address space of chunks is retained: decommitted pages are reused before new chunk is mapped.
+     */
+    static class PagePool
+    {
+        Mutex   mutex;
+        char*   chunk;          // unused part of the last mapped chunk
+        size_t  nUnused;        // number of pages in the unused part of the chunk
+        MemoryPage** released;  // stack of decommitted pages
+        size_t  nReleased;      // number of decommitted pages
+        size_t  maxReleased;    // allocated size of the stack of decommitted pages
+
+      public:
+        MemoryPage* allocate() { 
+            CriticalSection cs(mutex);
+            if (nReleased != 0) { 
+                MemoryPage* page = released[--nReleased];
+#ifdef _WIN32
+                if (VirtualAlloc(page, MemoryPage::PAGE_SIZE, MEM_COMMIT, PAGE_READWRITE) == NULL) { 
+                    nReleased += 1;
+                    return NULL;
+                }
+#endif
+                return page;
+            }
+            if (nUnused == 0) { 
+                MemoryPage* newChunk = mapPage(PAGES_PER_CHUNK*MemoryPage::PAGE_SIZE);
+                if (newChunk == NULL) { 
+                    return NULL;
+                }
+                chunk = (char*)newChunk;
+                nUnused = PAGES_PER_CHUNK;
+            }
+            MemoryPage* page = (MemoryPage*)chunk;
+            chunk += MemoryPage::PAGE_SIZE;
+            nUnused -= 1;
+            return page;
+        }
+
+        void release(MemoryPage* page) { 
+#ifdef _WIN32
+            VirtualFree(page, MemoryPage::PAGE_SIZE, MEM_DECOMMIT);
+#else
+            madvise(page, MemoryPage::PAGE_SIZE, MADV_DONTNEED);
+#endif
+            CriticalSection cs(mutex);
+            if (nReleased == maxReleased) { 
+                size_t newSize = maxReleased == 0 ? PAGES_PER_CHUNK : maxReleased*2;
+                MemoryPage** newStack = (MemoryPage**)realloc(released, newSize*sizeof(MemoryPage*));
+                if (newStack == NULL) { // page is not reused, but its physical memory is already returned
+                    return;
+                }
+                released = newStack;
+                maxReleased = newSize;
+            }
+            released[nReleased++] = page;
+        }
+    } pagePool;
+
+    /**
+     * Monotonic time in milliseconds
+     */
+    static size_t getCurrentTime()
+    {
+#ifdef _WIN32
+        return (size_t)GetTickCount64();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (size_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#endif
+    }
+
+    MemoryPage* MemoryAllocator::allocatePage(size_t pageSize, bool mapped)
+    {
+        MemoryPage* page;
+        // Parcel also takes empty pages cached by allocator of its thread
+        for (MemoryAllocator* cache = this; cache != NULL && pageSize == MemoryPage::PAGE_SIZE; cache = cache->parent) { 
+            CriticalSection cs(cache->sweepMutex); // pages are also released by sweeper thread
+            if (cache->freePages != NULL) { 
+                page = cache->freePages;
+                cache->freePages = page->next;
+                cache->nCachedPages -= 1;
+                page->owner = this;
+                page->young = false;
+                page->dirty = false;
+                page->region = false;
+                page->nPending = 0;
+                page->nFinalizable = 0;
+                page->pointerFree = false;
+                memset(page->cards, 0, sizeof(page->cards));
+                return page;
+            }
+        }
+        if (mapped) { 
+            page = pageSize == MemoryPage::PAGE_SIZE ? pagePool.allocate() : mapPage(pageSize);
+        } else { 
+#ifdef _WIN32
+            page = (MemoryPage*)_aligned_malloc(pageSize, MemoryPage::PAGE_SIZE);
+#else
+            if (posix_memalign((void**)&page, MemoryPage::PAGE_SIZE, pageSize) != 0) { 
+                page = NULL;
+            }
+#endif
+        }
+        if (page != NULL) { 
+            memset(page->markBits, 0, sizeof(page->markBits));
+            memset(page->cards, 0, sizeof(page->cards));
+            page->owner = this;
+            page->pageSize = pageSize;
+            page->mapped = mapped;
+            page->young = false;
+            page->dirty = false;
+            page->region = false;
+            page->nPending = 0;
+            page->nFinalizable = 0;
+            page->pointerFree = false;
+            PageMap::set(page, page);
+        }
+        return page;
+    }
+
+    void MemoryAllocator::freePage(MemoryPage* page)
+    {
+        if (page->pageSize == MemoryPage::PAGE_SIZE && memoryDecay != 0) { // keep empty page for reuse
+            size_t now = getCurrentTime();
+            CriticalSection cs(sweepMutex);
+            if (nCachedPages < MAX_CACHED_PAGES) { 
+                page->freeTime = now;
+                page->next = freePages;
+                freePages = page;
+                nCachedPages += 1;
+                return;
+            }
+        }
+        releasePage(page);
+    }
+
+    void MemoryAllocator::releasePage(MemoryPage* page)
+    {
+        PageMap::set(page, NULL);
+        if (page->mapped) { 
+            if (page->pageSize == MemoryPage::PAGE_SIZE) { 
+                pagePool.release(page);
+            } else { 
+                unmapPage(page, page->pageSize);
+            }
+        } else { 
+#ifdef _WIN32
+            _aligned_free(page);
+#else
+            free(page);
+#endif
+        }
+    }
+
+    void MemoryAllocator::releaseFreePages(size_t releaseTime)
+    {
+        MemoryPage *page, *next;
+        {
+            CriticalSection cs(sweepMutex);
+            MemoryPage** pp = &freePages;
+            // Cached pages are ordered by time of their release, so expired pages form tail of the list
+            while ((page = *pp) != NULL && page->freeTime > releaseTime) { 
+                pp = &page->next;
+            }
+            *pp = NULL;
+            for (next = page; next != NULL; next = next->next) { 
+                nCachedPages -= 1;
+            }
+        }
+        for (; page != NULL; page = next) { 
+            next = page->next;
+            releasePage(page);
+        }
+    }
+
+    void MemoryAllocator::decayFreePages()
+    {
+        if (memoryDecay != (size_t)-1 && freePages != NULL) { 
+            size_t now = getCurrentTime();
+            if (now >= memoryDecay) { 
+                releaseFreePages(now - memoryDecay);
+            }
+        }
+    }
+
+    void MemoryAllocator::_releaseMemory()
+    {
+        releaseFreePages((size_t)-1);
+    }
+
+    ObjectHeader* MemoryAllocator::allocateSmall(SizeClass* sc)
+    {
+        if (sweepPending) { 
+            // Take free slots of pages swept by sweeper thread or sweep next page ourselves
+            MemoryPage* page;
+            while (sc->freeList == NULL && !refillFreeList(sc) && (page = takeUnsweptPage(sc)) != NULL) { 
+                sweepPage(sc, page);
+            }
+        }
+
+        ObjectHeader* hdr = sc->freeList;
+        if (hdr == NULL) { 
+            size_t slotSize = sizeClasses[(sc - classes) % MemoryPage::N_SIZE_CLASSES];
+            MemoryPage* page = allocatePage(MemoryPage::PAGE_SIZE, true);
+            if (page == NULL) { 
+                return NULL;
+            }
+            page->pointerFree = sc - classes >= MemoryPage::N_SIZE_CLASSES;
+            page->slotSize = slotSize;
+            page->nSlots = (MemoryPage::PAGE_SIZE - sizeof(MemoryPage)) / slotSize;
+            page->next = sc->pages;
+            sc->pages = page;
+
+            // Link all slots of the new page in free list
+            ObjectHeader* next = NULL;
+            for (size_t i = page->nSlots; i-- != 0;) { 
+                hdr = page->getSlot(i);
+                hdr->next = (ObjectHeader*)((size_t)next | FREE_SLOT);
+                next = hdr;
+            }
+        }
+        sc->freeList = (ObjectHeader*)((size_t)hdr->next & ~FREE_SLOT);
+        return hdr;
+    }
+
+    ObjectHeader* MemoryAllocator::allocateLarge(size_t size, bool pointerFree)
+    {
+        if (sweepPending) { 
+            sweepLargePages();
+        }
+        size_t pageSize = (sizeof(MemoryPage) + size + MemoryPage::PAGE_SIZE - 1) & ~((size_t)MemoryPage::PAGE_SIZE - 1);
+        MemoryPage* page = allocatePage(pageSize, size >= largeObjectThreshold);
+        if (page == NULL) { 
+            return NULL;
+        }
+        page->pointerFree = pointerFree;
+        page->slotSize = size;
+        page->nSlots = 1;
+        if (nurserySize != 0) { // large page is included in list of old pages after promotion
+            page->young = true;
+            page->nextYoung = youngPages;
+            youngPages = page;
+            return page->getSlot(0);
+        }
+        CriticalSection cs(sweepMutex); // sweeper thread adds live pages to this list
+        page->next = largePages;
+        largePages = page;
+        return page->getSlot(0);
+    }
+
+    bool MemoryAllocator::findFreeLines()
+    {
+        while (true) { 
+            if (currentBlock != NULL) { // continue search in the current block
+                size_t line = nextLine;
+                while (line < MemoryPage::N_LINES && currentBlock->lines[line]) { 
+                    line += 1;
+                }
+                if (line < MemoryPage::N_LINES) { 
+                    size_t end = line + 1;
+                    while (end < MemoryPage::N_LINES && !currentBlock->lines[end]) { 
+                        end += 1;
+                    }
+                    regionCursor = (char*)currentBlock + line*MemoryPage::LINE_SIZE;
+                    regionLimit = (char*)currentBlock + end*MemoryPage::LINE_SIZE;
+                    nextLine = end;
+                    return true;
+                }
+                currentBlock = NULL;
+            }
+            MemoryPage* page;
+            {
+                CriticalSection cs(sweepMutex); // recycled blocks are added by sweeper thread
+                page = recyclableBlocks;
+                if (page != NULL) { 
+                    recyclableBlocks = page->next;
+                    page->next = blocks;
+                    blocks = page;
+                }
+            }
+            if (page == NULL) { 
+                if (sweepPending && (page = takeUnsweptBlock()) != NULL) { 
+                    sweepBlock(page);
+                    continue;
+                }
+                page = allocatePage(MemoryPage::PAGE_SIZE, true);
+                if (page == NULL) { 
+                    return false;
+                }
+                page->region = true;
+                page->slotSize = 0;
+                page->nSlots = 0;
+                memset(page->lines, 0, sizeof(page->lines));
+                memset(page->lines, 1, FIRST_LINE);
+                CriticalSection cs(sweepMutex);
+                page->next = blocks;
+                blocks = page;
+            }
+            currentBlock = page;
+            nextLine = FIRST_LINE;
+        }
+    }
+
+    ObjectHeader* MemoryAllocator::allocateInRegion(size_t size)
+    {
+        while (size > (size_t)(regionLimit - regionCursor)) { 
+            if (!findFreeLines()) { 
+                return NULL;
+            }
+        }
+        ObjectHeader* hdr = (ObjectHeader*)regionCursor;
+        regionCursor += size;
+        return hdr;
+    }
 
-    void* MemoryAllocator::_allocate(size_t size) 
+    void* MemoryAllocator::_allocate(size_t size, bool pointerFree) 
     {
-        
-        ObjectHeader* hdr = (ObjectHeader*)malloc(sizeof(ObjectHeader) + size);        
+        if (safepointRequested && autoStartThreshold != (size_t)-1) { // other thread is collecting shared heap and all our objects are protected by roots
+            safepoint();
+        }
+        if (allocated > autoStartThreshold) {
+            getCurrent()->_gc(false); // caller may hold direct pointers to objects, so they are not moved
+        } else if (incrementalMarking && allocated >= nextMarkSlice) { 
+            markSlice(markSliceSize); // marking is completed only at GC point
+            nextMarkSlice = allocated + markSliceStep;
+        }
+        size_t slotSize = (sizeof(ObjectHeader) + size + 15) & ~15;
+        ObjectHeader* hdr;
+        if (slotSize <= MemoryPage::LINE_SIZE && layout == MARK_REGION && nurserySize == 0 && (!pointerFree || parent != NULL)) { // parcel is packed in blocks
+            hdr = allocateInRegion(slotSize);
+        } else if (slotSize <= MemoryPage::MAX_SMALL_SIZE) { 
+            size_t i = sizeClassMap.index[slotSize >> 4];
+            slotSize = sizeClasses[i];
+            hdr = allocateSmall(&classes[pointerFree ? MemoryPage::N_SIZE_CLASSES + i : i]);
+        } else { 
+            hdr = allocateLarge(slotSize, pointerFree);
+        }
         if (hdr != NULL) { 
-            if (allocated > autoStartThreshold) {
-                gc();
+            hdr->next = NULL;
+            allocated += slotSize;
+            Object* obj = hdr->getObject();
+            MemoryPage* page = MemoryPage::getPage(obj);
+            if (incrementalMarking) { // objects created during incremental marking are black
+                size_t bit = MemoryPage::getBitIndex(obj);
+                page->markBits[bit / BITS_PER_WORD] |= (size_t)1 << (bit % BITS_PER_WORD);
             }
-            hdr->next = objects;
-            objects = hdr;
-            allocated += sizeof(ObjectHeader) + size;
-            return hdr->getObject();
+            if (!page->young && nurserySize != 0) { // page will be swept by minor GC
+                page->young = true;
+                page->nextYoung = youngPages;
+                youngPages = page;
+            }
+            return obj;
         }
         return NULL;
     }
@@ -25,62 +584,331 @@ namespace GC
     void MemoryAllocator::_visit(AnyWeakRef* wref)
     {
         if (wref->obj != NULL) { 
-            wref->next = weakReferences;
-            weakReferences = wref;
+            if (compacting) { 
+                updateRef(&wref->obj);
+            } else if (probing) { 
+                _mark(wref->obj);
+            } else if (minorMarking && MemoryPage::getPage(wref->obj)->owner != this) { 
+                // foreign object is not marked by minor GC
+            } else if (!tracing) { // weak reference is copied by mutator during incremental marking
+                _mark(wref->obj);
+            } else if (heap != NULL) { // weak references of shared heap are reset by the thread performing GC
+                CriticalSection cs(heap->mutex);
+                if (wref->next == NULL) { 
+                    wref->next = heap->weakReferences;
+                    heap->weakReferences = wref;
+                }
+            } else if (parallelMarking) { 
+                CriticalSection cs(markMutex);
+                if (wref->next == NULL) { 
+                    wref->next = weakReferences;
+                    weakReferences = wref;
+                }
+            } else if (wref->next == NULL) { // object may be traversed more than once after mark stack overflow
+                wref->next = weakReferences;
+                weakReferences = wref;
+            }
         }
     }
 
     void MemoryAllocator::_registerRoot(Root* root)
     {
-        root->next = roots;
-        roots = root;
+        if (nRoots == rootStackSize) { 
+            size_t newSize = rootStackSize == 0 ? INIT_ROOT_STACK_SIZE : rootStackSize*2;
+            Root** newStack = (Root**)realloc(rootStack, newSize*sizeof(Root*));
+            assert(newStack != NULL);
+            rootStack = newStack;
+            rootStackSize = newSize;
+        }
+        root->index = nRoots;
+        root->allocator = this;
+        rootStack[nRoots++] = root;
+    }
+
+    void MemoryAllocator::unregisterRoot(Root* root)
+    {
+        root->allocator->_unregisterRoot(root);
     }
     
     void MemoryAllocator::_unregisterRoot(Root* root)
     {
-        Root *rp, **rpp;
-        for (rpp = &roots; (rp = *rpp) != root; rpp = &rp->next) { 
-            assert(rp != NULL);
+        size_t i = root->index;
+        if (i < nRoots && rootStack[i] == root) { // root may be already released by RootScope
+            rootStack[i] = NULL; // root is not at the top of the stack: leave a hole which is popped together with the top
+            while (nRoots != 0 && rootStack[nRoots-1] == NULL) { 
+                nRoots -= 1;
+            }
+        }
+    }
+
+    size_t MemoryAllocator::_getRootStackHeight()
+    {
+        return nRoots;
+    }
+
+    void MemoryAllocator::_releaseRoots(size_t height)
+    {
+        if (height < nRoots) { 
+            nRoots = height;
+        }
+    }
+
+    MarkStack::MarkStack()
+    {
+        items = NULL;
+        used = allocated = 0;
+        limit = MAX_MARK_STACK_SIZE;
+    }
+
+    MarkStack::~MarkStack()
+    {
+        free(items);
+    }
+
+    bool MarkStack::extend()
+    {
+        size_t newSize = allocated == 0 ? INIT_MARK_STACK_SIZE : allocated*2;
+        if (newSize > limit) { 
+            newSize = limit;
+        }
+        if (newSize <= allocated) { 
+            return false;
+        }
+        Object** newItems = (Object**)realloc(items, newSize*sizeof(Object*));
+        if (newItems == NULL) { 
+            return false;
+        }
+        items = newItems;
+        allocated = newSize;
+        return true;
+    }
+
+    RememberedSet::RememberedSet()
+    {
+        table = NULL;
+        used = allocated = 0;
+    }
+
+    RememberedSet::~RememberedSet()
+    {
+        free(table);
+    }
+
+    void RememberedSet::add(Object* obj, MemoryAllocator* source, size_t epoch)
+    {
+        if ((used + 1)*3 > allocated*2) { // keep load factor below 2/3
+            Entry* oldTable = table;
+            size_t oldSize = allocated;
+            allocated = allocated == 0 ? INIT_REMEMBERED_SET_SIZE : allocated*2;
+            table = (Entry*)calloc(allocated, sizeof(Entry));
+            assert(table != NULL);
+            used = 0;
+            for (size_t i = 0; i < oldSize; i++) { 
+                if (oldTable[i].obj != NULL) { 
+                    add(oldTable[i].obj, oldTable[i].source, oldTable[i].epoch);
+                }
+            }
+            free(oldTable);
+        }
+        size_t mask = allocated - 1;
+        for (size_t i = ((size_t)obj / MemoryPage::GRANULE ^ (size_t)source / sizeof(MemoryAllocator)) & mask;; i = (i + 1) & mask) { 
+            Entry* e = &table[i];
+            if (e->obj == NULL) { 
+                e->obj = obj;
+                e->source = source;
+                e->epoch = epoch;
+                used += 1;
+                return;
+            }
+            if (e->obj == obj && e->source == source) { 
+                if (e->epoch < epoch) { 
+                    e->epoch = epoch;
+                }
+                return;
+            }
+        }
+    }
+
+    void RememberedSet::purge(MemoryAllocator* source, size_t epoch)
+    {
+        for (size_t i = 0; i < allocated; i++) { // entry stored by barrier before purge is either found by the next mark phase or removed by it
+            if (table[i].obj != NULL && table[i].source == source && table[i].epoch == UNCONFIRMED_EPOCH) { 
+                table[i].epoch = epoch;
+            }
+        }
+        rebind(source, epoch, NULL, 0);
+    }
+
+    void RememberedSet::rebind(MemoryAllocator* source, size_t epoch, MemoryAllocator* newSource, size_t newEpoch)
+    {
+        size_t i, n = 0;
+        for (i = 0; i < allocated; i++) { 
+            n += table[i].obj != NULL && table[i].source == source && table[i].epoch < epoch;
+        }
+        if (n == 0) { 
+            return;
         }
-        *rpp = rp->next;
+        // Entries can not be removed from hash table with open addressing in place: rebuild the table
+        Entry* oldTable = table;
+        table = (Entry*)calloc(allocated, sizeof(Entry));
+        assert(table != NULL);
+        used = 0;
+        for (i = 0; i < allocated; i++) { 
+            Entry* e = &oldTable[i];
+            if (e->obj == NULL) { 
+                continue;
+            }
+            if (e->source == source && e->epoch < epoch) { 
+                if (newSource != NULL) { 
+                    add(e->obj, newSource, newEpoch);
+                }
+            } else { 
+                add(e->obj, e->source, e->epoch);
+            }
+        }
+        free(oldTable);
+    }
+
+    void RememberedSet::clear()
+    {
+        free(table);
+        table = NULL;
+        used = allocated = 0;
+    }
+
+    /**
+     * Atomically set bits in the word
+     * @return old value of the word
+     */
+    static inline size_t atomicOr(size_t* word, size_t bits)
+    {
+#ifdef _WIN32
+        return (size_t)InterlockedOr64((LONG64 volatile*)word, (LONG64)bits);
+#else
+        return __sync_fetch_and_or(word, bits);
+#endif
+    }
+
+    /**
+     * Atomically add value to the counter
+     */
+    static inline void atomicAdd(size_t volatile* counter, size_t value)
+    {
+#ifdef _WIN32
+        InterlockedExchangeAdd64((LONG64 volatile*)counter, (LONG64)value);
+#else
+        __sync_fetch_and_add(counter, value);
+#endif
     }
 
     void MemoryAllocator::_mark(Object* obj)
     {
-        if (obj != NULL) { 
-            ObjectHeader* hdr = obj->getHeader();
-            size_t next = (size_t)hdr->next;
-            if ((next & BLACK_MARK) == 0) { 
-                hdr->next = (ObjectHeader*)(next + BLACK_MARK);
-                obj->mark(this); // mark referenced objects
+        if (obj != NULL && marking) { 
+            MemoryPage* page = MemoryPage::getPage(obj);
+            if (page->owner != this && (heap == NULL || page->owner->heap != heap)) { // object of other heap is not traversed
+                if (!minorMarking) { // but it is kept alive by GC of its owner while this reference is found by major GC
+                    page->owner->rememberIncoming(obj, this, markEpoch);
+                }
+                return;
+            }
+            size_t bit = MemoryPage::getBitIndex(obj);
+            size_t* word = &page->markBits[bit / BITS_PER_WORD];
+            size_t mask = (size_t)1 << (bit % BITS_PER_WORD);
+            if ((*word & mask) == 0) { 
+                MarkStack* stack = &markStack;
+                if (parallelMarking) { 
+                    if (atomicOr(word, mask) & mask) { // object was concurrently marked by other thread
+                        return;
+                    }
+                    stack = markStackCtx.get();
+                } else if (heap == NULL) { 
+                    *word |= mask;
+                } else if (atomicOr(word, mask) & mask) { // object of shared heap may be concurrently marked by other thread
+                    return;
+                }
+                if (page->pointerFree) { // nothing to traverse
+                    return;
+                }
+                if (!stack->push(obj)) { // references will be traversed by rescanMarkedObjects()
+                    markStackOverflow = true;
+                }
+            }
+        } else if (probing && obj != NULL) { 
+            if (MemoryPage::getPage(obj)->owner == this && !MemoryPage::isMarked(obj)) { 
+                youngRefFound = true;
             }
         }
     }
 
     void MemoryAllocator::_mark(Object** refs, size_t nRefs) 
     {  
-        for (size_t i = 0; i < nRefs; i++) { 
-            _mark(refs[i]);
+        if (compacting) { 
+            for (size_t i = 0; i < nRefs; i++) { 
+                updateRef(&refs[i]);
+            }
+            return;
+        }
+        if (parallelMarking && nRefs > MarkPacket::SIZE) { // let other threads mark the rest of array
+            shareMarkWork(refs + MarkPacket::SIZE, nRefs - MarkPacket::SIZE);
+            nRefs = MarkPacket::SIZE;
+        }
+        // Mark bits of array elements are usually located in different pages: 
+        // first issue prefetches for the whole batch, so that cache misses are overlapped
+        for (size_t i = 0; i < nRefs; i += PREFETCH_BATCH) { 
+            size_t n = nRefs - i < PREFETCH_BATCH ? nRefs - i : PREFETCH_BATCH;
+            Object** batch = refs + i;
+            size_t j, nObjects = 0;
+            Object* objects[PREFETCH_BATCH];
+            for (j = 0; j < n; j++) { 
+                Object* obj = batch[j];
+                if (obj != NULL) { 
+                    prefetchMarkBit(obj);
+                    objects[nObjects++] = obj;
+                }
+            }
+            for (j = 0; j < nObjects; j++) { 
+                _mark(objects[j]);
+            }
         }
     }
 
-    void MemoryAllocator::_allowGC()
+    void MemoryAllocator::_pin(Object* obj)
     {
-        if (allocated > startThreshold) {
-            _gc();
+        if (obj != NULL && pinning) { 
+            MemoryPage* page = MemoryPage::getPage(obj);
+            if (isMovable(page, this)) { 
+                size_t bit = MemoryPage::getBitIndex(obj);
+                atomicOr(&page->oldBits[bit / BITS_PER_WORD], (size_t)1 << (bit % BITS_PER_WORD)); // roots may be traversed by several mark threads
+            }
         }
+        _mark(obj);
     }
 
-    MemoryAllocator* MemoryAllocator::getCurrent() 
-    { 
-        MemoryAllocator* allocator = ctx.get();
-        assert(allocator != NULL);
-        return allocator;
-    }
-
-    void* MemoryAllocator::allocate(size_t size) 
+    void MemoryAllocator::_allowGC()
     {
-        return getCurrent()->_allocate(size);
+        if (zombies != NULL) { 
+            processZombies();
+        }
+        if (heap != NULL) { // shared heap is collected only by stop-the-world GC
+            if (safepointRequested) { 
+                safepoint();
+            } else if (allocated > startThreshold) { 
+                collectSharedHeap();
+            }
+        } else if (incrementalMarking) { 
+            if (markSlice(markSliceSize)) { // no more grey objects
+                finishMarkPhase();
+                sweepPhase();
+            }
+        } else if (allocated > startThreshold) {
+            if (markSliceSize == 0 || compactionPending) { 
+                _gc();
+            } else if (!sweepPending || sweepSlice(markSliceSize)) { // mark bits are needed until all pages are swept
+                startIncrementalMarking();
+            }
+        } else if (nurserySize != 0 && allocated - nurseryStart > nurserySize) { 
+            minorGC();
+        }
     }
 
     void MemoryAllocator::mark(Object* obj) 
@@ -88,11 +916,19 @@ namespace GC
         if (obj != NULL) { 
             MemoryAllocator* curr = ctx.get();
             if (curr != NULL) { 
-                curr->_mark(obj);
+                curr->_pin(obj); // location of the reference is unknown, so object can not be moved
             }
         }
     } 
 
+    void MemoryAllocator::traceRef(Object* const* ref) 
+    { 
+        MemoryAllocator* curr = ctx.get();
+        if (curr != NULL) { 
+            curr->_markRef(ref);
+        }
+    } 
+
     void MemoryAllocator::mark(Object** refs, size_t nRefs) 
     {  
         MemoryAllocator* curr = ctx.get();
@@ -109,19 +945,34 @@ namespace GC
         }
     }
 
-    void MemoryAllocator::registerRoot(Root* root) 
-    {
-        getCurrent()->_registerRoot(root);
+    void MemoryAllocator::gc() 
+    { 
+        getCurrent()->_gc();
     }
-            
-    void MemoryAllocator::unregisterRoot(Root* root) 
-    {
-        getCurrent()->_unregisterRoot(root);
+
+    void MemoryAllocator::compact() 
+    { 
+        getCurrent()->_compact();
     }
 
-    void MemoryAllocator::gc() 
+    void MemoryAllocator::beginParcel() 
     { 
-        getCurrent()->_gc();
+        getCurrent()->_beginParcel();
+    }
+
+    Parcel* MemoryAllocator::endParcel(Object* root) 
+    { 
+        return getCurrent()->_endParcel(root);
+    }
+
+    Object* MemoryAllocator::openParcel(Parcel* parcel) 
+    { 
+        return getCurrent()->_openParcel(parcel);
+    }
+
+    void MemoryAllocator::finishSweep() 
+    { 
+        getCurrent()->_finishSweep();
     }
     
     void MemoryAllocator::allowGC()
@@ -129,57 +980,2050 @@ namespace GC
         getCurrent()->_allowGC();
     } 
 
+    void MemoryAllocator::releaseMemory()
+    { 
+        getCurrent()->_releaseMemory();
+    } 
+
+    size_t MemoryAllocator::runFinalizers(size_t maxObjects)
+    { 
+        return getCurrent()->_runFinalizers(maxObjects);
+    } 
+
+    size_t MemoryAllocator::liveSize()
+    { 
+        return getCurrent()->_liveSize();
+    } 
+
     MemoryAllocator::MemoryAllocator(size_t gcStartThreshold, size_t gcAutoStartThreshold)
     {
         allocated = 0;
-        roots = NULL;
-        objects = NULL;
+        rootStack = NULL;
+        nRoots = 0;
+        rootStackSize = 0;
+        memset(classes, 0, sizeof classes);
+        largePages = NULL;
+        unsweptLargePages = NULL;
+        largeObjectThreshold = DEFAULT_LARGE_OBJECT_THRESHOLD;
+        layout = SEGREGATED_FITS;
+        blocks = NULL;
+        recyclableBlocks = NULL;
+        unsweptBlocks = NULL;
+        currentBlock = NULL;
+        nextLine = 0;
+        regionCursor = NULL;
+        regionLimit = NULL;
+        finalizableObjects.limit = (size_t)-1;
+        lazySweep = false;
+        sweepPending = false;
+        freePages = NULL;
+        nCachedPages = 0;
+        memoryDecay = DEFAULT_MEMORY_DECAY;
+        weakReferences = LAST_WEAK_REF;
+        marking = false;
+        markStackOverflow = false;
+        tracing = false;
+        markSliceSize = 0;
+        markSliceStep = 0;
+        nextMarkSlice = 0;
+        incrementalMarking = false;
+        nurserySize = 0;
+        promotionAge = 0;
+        nurseryStart = 0;
+        youngPages = NULL;
+        dirtyPages = NULL;
+        rememberedObjects.limit = (size_t)-1;
+        probing = false;
+        youngRefFound = false;
+        minorMarking = false;
+        nMarkThreads = 1;
+        markWorkers = NULL;
+        parallelMarking = false;
+        markPackets = NULL;
+        freeMarkPackets = NULL;
+        nextRoot = 0;
+        markCycle = 0;
+        nActiveHelpers = 0;
+        markingDone = false;
+        shutdown = false;
+        nIdleMarkers = 0;
+        sweeper = NULL;
+        sweepCycle = 0;
+        nPagesInSweep = 0;
+        stopSweeper = false;
+        zombies = NULL;
+        finalizationQueue = NULL;
+        finalizer = NULL;
+        stopFinalizer = false;
         startThreshold = gcStartThreshold;
         autoStartThreshold = gcAutoStartThreshold;
+        liveObjectsSize = 0;
+        growthPercent = 0;
+        autoStartPercent = 0;
+        minThreshold = 0;
+        maxThreshold = (size_t)-1;
+        pinning = false;
+        compacting = false;
+        compactionPending = false;
+        compactionThreshold = 0;
+        heap = NULL;
+        nextMember = NULL;
+        safepointRequested = false;
+        inSafeRegion = false;
+        parent = NULL;
+        markEpoch = 0;
+        {
+            CriticalSection cs(allocatorsMutex);
+            nextAllocator = allocators;
+            allocators = this;
+            atomicAdd(&nAllocators, 1);
+        }
         ctx.set(this);
     }
 
     MemoryAllocator::~MemoryAllocator()
     {
-        ObjectHeader *hdr, *next;
-        for (hdr = objects; hdr != NULL; hdr = next) { 
-            next = (ObjectHeader*)((size_t)hdr->next & ~BLACK_MARK);
-            free(hdr);
+        setSharedHeap(NULL);
+        {
+            CriticalSection cs(allocatorsMutex);
+            MemoryAllocator** app = &allocators;
+            while (*app != this) { 
+                app = &(*app)->nextAllocator;
+            }
+            *app = nextAllocator;
+            atomicAdd(&nAllocators, (size_t)-1);
+            for (MemoryAllocator* owner = allocators; owner != NULL; owner = owner->nextAllocator) { // references from this heap are destroyed
+                CriticalSection ocs(owner->incomingMutex);
+                owner->incoming.rebind(this, (size_t)-1, NULL, 0); // including entries not confirmed by GC of this allocator
+            }
         }
-    }
-
-    void MemoryAllocator::_gc() 
-    {
-        markPhase();
-        sweepPhase();
-    }
-    
-    void MemoryAllocator::markPhase() 
-    {
-        weakReferences = NULL;
-        for (Root* root = roots; root != NULL; root = root->next) { 
-            root->mark(this); 
+        if (incrementalMarking) { 
+            atomicAdd(&nIncrementalMarkers, (size_t)-1);
         }
-        for (AnyWeakRef* wref = weakReferences; wref != NULL; wref = wref->next) { 
-            if (((size_t)wref->obj & BLACK_MARK) == 0) { 
-                wref->obj = NULL;
+        if (nurserySize != 0) { 
+            atomicAdd(&nGenerationalAllocators, (size_t)-1);
+        }
+        stopSweepThread();
+        stopFinalizerThread();
+        stopMarkThreads();
+        _runFinalizers((size_t)-1); // large pages of finalized objects are not included in any list
+        MarkPacket *packet, *nextPacket;
+        for (packet = freeMarkPackets; packet != NULL; packet = nextPacket) { 
+            nextPacket = packet->next;
+            delete packet;
+        }
+        MemoryPage *page, *next;
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            for (page = classes[i].pages; page != NULL; page = next) { 
+                next = page->next;
+                freePage(page);
             }
         }
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            for (page = classes[i].unswept; page != NULL; page = next) { 
+                next = page->next;
+                freePage(page);
+            }
+            for (page = classes[i].swept; page != NULL; page = next) { 
+                next = page->next;
+                freePage(page);
+            }
+        }
+        for (page = largePages; page != NULL; page = next) { 
+            next = page->next;
+            freePage(page);
+        }
+        for (page = youngPages; page != NULL; page = next) { 
+            next = page->nextYoung;
+            if (page->slotSize > MemoryPage::MAX_SMALL_SIZE) { // young large pages are not included in other lists
+                freePage(page);
+            }
+        }
+        for (page = unsweptLargePages; page != NULL; page = next) { 
+            next = page->next;
+            freePage(page);
+        }
+        MemoryPage* blockLists[] = { blocks, recyclableBlocks, unsweptBlocks };
+        for (size_t i = 0; i < sizeof(blockLists)/sizeof(*blockLists); i++) { 
+            for (page = blockLists[i]; page != NULL; page = next) { 
+                next = page->next;
+                freePage(page);
+            }
+        }
+        _releaseMemory();
+        free(rootStack);
+    }
+
+    void MemoryAllocator::_gc(bool mayCompact) 
+    {
+        if (heap != NULL) { 
+            collectSharedHeap();
+            return;
+        }
+        if (compactionPending && mayCompact) { 
+            _compact();
+            return;
+        }
+        if (!incrementalMarking) { // otherwise just complete incremental marking
+            _finishSweep(); // mark bits of the previous GC are still needed by unswept pages
+            markPhase();
+        }
+        finishMarkPhase();
+        sweepPhase();
+    }
+    
+    void MemoryAllocator::setMarkStackLimit(size_t maxItems)
+    {
+        markStack.limit = maxItems;
+    }
+
+    void MemoryAllocator::setLargeObjectThreshold(size_t threshold)
+    {
+        largeObjectThreshold = threshold;
+    }
+
+    void MemoryAllocator::setMemoryDecay(size_t decayTime)
+    {
+        memoryDecay = decayTime;
+        decayFreePages();
+    }
+
+    void MemoryAllocator::setAdaptiveThreshold(size_t growth, size_t minSize, size_t maxSize)
+    {
+        growthPercent = growth;
+        minThreshold = minSize;
+        maxThreshold = maxSize;
+        // Keep proportion between thresholds of automatic and explicit start of GC
+        autoStartPercent = autoStartThreshold == (size_t)-1 ? 0 
+            : startThreshold >= 100 ? autoStartThreshold / (startThreshold / 100) : 100;
+    }
+
+    void MemoryAllocator::adjustThresholds()
+    {
+        if (growthPercent != 0) { 
+            size_t threshold = liveObjectsSize / 100 * growthPercent;
+            threshold = threshold < minThreshold ? minThreshold : threshold > maxThreshold ? maxThreshold : threshold;
+            startThreshold = threshold;
+            if (autoStartPercent != 0) { 
+                autoStartThreshold = threshold / 100 * autoStartPercent;
+            }
+        }
+    }
+
+    void MemoryAllocator::setCompactionThreshold(size_t fragmentationPercent)
+    {
+        compactionThreshold = fragmentationPercent;
+        if (fragmentationPercent == 0) { 
+            compactionPending = false;
+        }
+    }
+
+    void MemoryAllocator::setHeapLayout(HeapLayout heapLayout)
+    {
+        layout = heapLayout;
+        currentBlock = NULL; // it remains in the list of blocks
+        regionCursor = regionLimit = NULL;
+    }
+
+    void MemoryAllocator::_registerFinalizable(Object* obj)
+    {
+        MemoryPage* page = MemoryPage::getPage(obj);
+        if (page->region) { // objects in blocks are not visited by sweep
+            finalizableObjects.push(obj);
+        } else { 
+            atomicAdd(&page->nFinalizable, 1);
+        }
+    }
+
+    void MemoryAllocator::setLazySweep(bool enabled)
+    {
+        lazySweep = enabled;
+        if (!enabled) { 
+            _finishSweep();
+        }
+    }
+
+    void MemoryAllocator::setIncrementalMarking(size_t sliceSize, size_t sliceStep)
+    {
+        if (incrementalMarking && sliceSize == 0) { 
+            _gc(false);
+        }
+        markSliceSize = sliceSize;
+        markSliceStep = sliceStep;
+    }
+
+    void MemoryAllocator::setGenerational(size_t nursery, size_t age)
+    {
+        if ((nursery != 0) != (nurserySize != 0)) { 
+            _gc(false); // all live objects become old
+            atomicAdd(&nGenerationalAllocators, nursery != 0 ? 1 : (size_t)-1);
+        }
+        nurserySize = nursery;
+        promotionAge = age;
+    }
+
+    void MemoryAllocator::setBackgroundSweep(bool enabled)
+    {
+        _finishSweep();
+        stopSweepThread();
+        if (enabled) { 
+            stopSweeper = false;
+            sweeper = new Thread();
+            if (!sweeper->start(sweepThread, this)) { 
+                delete sweeper;
+                sweeper = NULL;
+            }
+        }
+    }
+
+    void MemoryAllocator::stopSweepThread()
+    {
+        if (sweeper != NULL) { 
+            sweepMutex.lock();
+            stopSweeper = true;
+            sweepEvent.signal();
+            sweepMutex.unlock();
+            sweeper->join();
+            delete sweeper;
+            sweeper = NULL;
+        }
+    }
+
+    void MemoryAllocator::setFinalizerThread(bool enabled)
+    {
+        stopFinalizerThread();
+        if (enabled) { 
+            stopFinalizer = false;
+            finalizer = new Thread();
+            if (!finalizer->start(finalizerThread, this)) { 
+                delete finalizer;
+                finalizer = NULL;
+            }
+        }
+    }
+
+    void MemoryAllocator::stopFinalizerThread()
+    {
+        if (finalizer != NULL) { 
+            sweepMutex.lock();
+            stopFinalizer = true;
+            finalizeEvent.signal();
+            sweepMutex.unlock();
+            finalizer->join();
+            delete finalizer;
+            finalizer = NULL;
+        }
+    }
+
+    void MemoryAllocator::finalizerThread(void* arg)
+    {
+        MemoryAllocator* allocator = (MemoryAllocator*)arg;
+        // Allocator context is not set for this thread: objects which destructors need it should be destructed by owner thread
+        while (true) { 
+            allocator->sweepMutex.lock();
+            while (allocator->finalizationQueue == NULL && !allocator->stopFinalizer) { 
+                allocator->finalizeEvent.wait(allocator->sweepMutex);
+            }
+            bool stop = allocator->finalizationQueue == NULL; // queue is drained before termination
+            allocator->sweepMutex.unlock();
+            if (stop) { 
+                break;
+            }
+            allocator->finalizeObjects(&allocator->finalizationQueue, (size_t)-1, false);
+        }
+    }
+
+    void MemoryAllocator::sweepThread(void* arg)
+    {
+        MemoryAllocator* allocator = (MemoryAllocator*)arg;
+        size_t cycle = 0;
+        // Allocator context is not set for this thread: objects which destructors need it should be destructed by owner thread
+        while (true) { 
+            for (size_t i = 0; i < N_CLASSES; i++) { 
+                SizeClass* sc = &allocator->classes[i];
+                MemoryPage* page;
+                while ((page = allocator->takeUnsweptPage(sc)) != NULL) { 
+                    allocator->sweepPage(sc, page);
+                }
+            }
+            allocator->sweepLargePages();
+            allocator->sweepBlocks();
+
+            allocator->sweepMutex.lock();
+            while (allocator->sweepCycle == cycle && !allocator->stopSweeper) { 
+                allocator->sweepEvent.wait(allocator->sweepMutex);
+            }
+            cycle = allocator->sweepCycle;
+            bool stop = allocator->stopSweeper;
+            allocator->sweepMutex.unlock();
+            if (stop) { 
+                break;
+            }
+        }
+    }
+
+    void MemoryAllocator::traceReferences()
+    {
+        Object* obj;
+        while ((obj = markStack.pop()) != NULL) { 
+            size_t top = markStack.size();
+            if (top > PREFETCH_DISTANCE) { // load object which will be traversed soon (unless new objects are pushed)
+                prefetch(markStack.peek(PREFETCH_DISTANCE));
+            }
+            obj->mark(this); // push referenced objects to the mark stack
+            markStack.reverse(top); // traverse references in the same order as recursive marking (usually allocation order)
+        }
+    }
+
+    void MemoryAllocator::rescanMarkedObjects()
+    {
+        while (markStackOverflow) { 
+            markStackOverflow = false;
+            if (heap != NULL) { // overflown object may belong to any allocator of shared heap
+                for (MemoryAllocator* member = heap->members; member != NULL; member = member->nextMember) { 
+                    rescanPages(member);
+                }
+            } else { 
+                rescanPages(this);
+            }
+        }
+    }
+
+    void MemoryAllocator::rescanPages(MemoryAllocator* owner)
+    {
+        for (size_t i = 0; i < MemoryPage::N_SIZE_CLASSES; i++) { // pointer-free objects have no references
+            for (MemoryPage* page = owner->classes[i].pages; page != NULL; page = page->next) { 
+                for (size_t j = 0, n = page->nSlots; j < n; j++) { 
+                    Object* obj = page->getSlot(j)->getObject();
+                    if (MemoryPage::isMarked(obj)) { 
+                        obj->mark(this);
+                        traceReferences();
+                    }
+                }
+            }
+        }
+        for (MemoryPage* page = owner->largePages; page != NULL; page = page->next) { 
+            Object* obj = page->getSlot(0)->getObject();
+            if (!page->pointerFree && MemoryPage::isMarked(obj)) { 
+                obj->mark(this);
+                traceReferences();
+            }
+        }
+        for (MemoryPage* page = owner->youngPages; page != NULL; page = page->nextYoung) { 
+            Object* obj = page->getSlot(0)->getObject();
+            if (page->slotSize > MemoryPage::MAX_SMALL_SIZE && !page->pointerFree && MemoryPage::isMarked(obj)) { 
+                obj->mark(this);
+                traceReferences();
+            }
+        }
+        for (MemoryPage* page = owner->blocks; page != NULL; page = page->next) { 
+            traceBlockObjects(page, 0, MemoryPage::PAGE_SIZE/MemoryPage::GRANULE, false);
+        }
+        for (MemoryPage* page = owner->recyclableBlocks; page != NULL; page = page->next) { 
+            traceBlockObjects(page, 0, MemoryPage::PAGE_SIZE/MemoryPage::GRANULE, false);
+        }
+    }
+
+    void MemoryAllocator::traceBlockObjects(MemoryPage* page, size_t from, size_t till, bool remember)
+    {
+        // Objects of blocks can not be enumerated: locate marked objects using mark bitmap
+        for (size_t bit = from; bit < till; bit++) { 
+            size_t word = page->markBits[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD);
+            if (word == 0) { // skip the rest of the word
+                bit |= BITS_PER_WORD - 1;
+                continue;
+            }
+            if (word & 1) { 
+                Object* obj = (Object*)((char*)page + bit*MemoryPage::GRANULE + sizeof(ObjectHeader));
+                obj->mark(this);
+                traceReferences();
+                if (remember && !rememberedObjects.push(obj)) { 
+                    markCard(page, obj);
+                }
+            }
+        }
+    }
+
+    void MemoryAllocator::clearMarks()
+    {
+        MemoryPage* page;
+        resetGenerations();
+        markEpoch += 1; // references to objects of other heaps are confirmed by this mark phase
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            for (page = classes[i].pages; page != NULL; page = page->next) { 
+                memset(page->markBits, 0, sizeof(page->markBits));
+            }
+        }
+        for (page = largePages; page != NULL; page = page->next) { 
+            memset(page->markBits, 0, sizeof(page->markBits));
+        }
+        for (page = blocks; page != NULL; page = page->next) { 
+            memset(page->markBits, 0, sizeof(page->markBits));
+        }
+        for (page = recyclableBlocks; page != NULL; page = page->next) { 
+            memset(page->markBits, 0, sizeof(page->markBits));
+        }
+    }
+
+    void MemoryAllocator::setMarkThreads(size_t nThreads)
+    {
+        stopMarkThreads();
+        if (nThreads > 1) { 
+            markWorkers = new MarkWorker*[nThreads-1];
+            shutdown = false;
+            for (size_t i = 0; i < nThreads-1; i++) { 
+                MarkWorker* worker = new MarkWorker();
+                worker->allocator = this;
+                worker->stack.limit = markStack.limit;
+                if (!worker->thread.start(markThread, worker)) { 
+                    delete worker;
+                    nThreads = i+1;
+                    break;
+                }
+                markWorkers[i] = worker;
+            }
+        }
+        nMarkThreads = nThreads;
+    }
+
+    void MemoryAllocator::stopMarkThreads()
+    {
+        if (markWorkers != NULL) { 
+            markMutex.lock();
+            shutdown = true;
+            markEvent.signal();
+            markMutex.unlock();
+            for (size_t i = 0; i < nMarkThreads-1; i++) { 
+                markWorkers[i]->thread.join();
+                delete markWorkers[i];
+            }
+            delete[] markWorkers;
+            markWorkers = NULL;
+        }
+        nMarkThreads = 1;
+    }
+
+    void MemoryAllocator::markThread(void* arg)
+    {
+        MarkWorker* worker = (MarkWorker*)arg;
+        MemoryAllocator* allocator = worker->allocator;
+        size_t cycle = 0;
+        ctx.set(allocator); // static methods invoked by mark() should use this allocator
+        markStackCtx.set(&worker->stack);
+        while (true) { 
+            allocator->markMutex.lock();
+            while (allocator->markCycle == cycle && !allocator->shutdown) { 
+                allocator->markEvent.wait(allocator->markMutex);
+            }
+            cycle = allocator->markCycle;
+            bool stop = allocator->shutdown;
+            allocator->markMutex.unlock();
+            if (stop) { 
+                break;
+            }
+            allocator->parallelMark(&worker->stack);
+
+            allocator->markMutex.lock();
+            if (--allocator->nActiveHelpers == 0) { 
+                allocator->markEvent.signal();
+            }
+            allocator->markMutex.unlock();
+        }
+    }
+
+    MarkPacket* MemoryAllocator::allocateMarkPacket()
+    {
+        MarkPacket* packet = freeMarkPackets;
+        if (packet != NULL) { 
+            freeMarkPackets = packet->next;
+        } else { 
+            packet = new MarkPacket();
+        }
+        return packet;
+    }
+
+    void MemoryAllocator::shareMarkWork(MarkStack* stack)
+    {
+        CriticalSection cs(markMutex);
+        MarkPacket* packet = allocateMarkPacket();
+        size_t n = 0, limit = stack->size()/2; // share half of our work
+        Object* obj;
+        while (n < limit && n < MarkPacket::SIZE && (obj = stack->pop()) != NULL) { 
+            packet->objects[n++] = obj;
+        }
+        packet->refs = packet->objects;
+        packet->nRefs = n;
+        packet->grey = true;
+        packet->next = markPackets;
+        markPackets = packet;
+        markEvent.signal();
+    }
+
+    void MemoryAllocator::shareMarkWork(Object** refs, size_t nRefs)
+    {
+        CriticalSection cs(markMutex);
+        while (nRefs != 0) { 
+            MarkPacket* packet = allocateMarkPacket();
+            size_t n = nRefs < MarkPacket::SIZE ? nRefs : MarkPacket::SIZE;
+            packet->refs = refs;
+            packet->nRefs = n;
+            packet->grey = false;
+            packet->next = markPackets;
+            markPackets = packet;
+            refs += n;
+            nRefs -= n;
+        }
+        markEvent.signal();
+    }
+
+    bool MemoryAllocator::getMarkWork(size_t& batch, MarkPacket*& packet)
+    {
+        CriticalSection cs(markMutex);
+        while (true) { 
+            if (markPackets != NULL) { 
+                packet = markPackets;
+                markPackets = packet->next;
+                return true;
+            }
+            if (nextRoot < nRoots) { 
+                batch = nextRoot;
+                nextRoot += ROOT_BATCH;
+                return true;
+            }
+            if (markingDone) { 
+                return false;
+            }
+            if (++nIdleMarkers == nMarkThreads) { // nobody has work
+                markingDone = true;
+                markEvent.signal();
+                return false;
+            }
+            markEvent.wait(markMutex);
+            if (!markingDone) {
+                nIdleMarkers -= 1;
+            }
+        }
+    }
+
+    void MemoryAllocator::parallelMark(MarkStack* stack)
+    {
+        size_t batch;
+        MarkPacket* packet;
+        Object* obj;
+        while (true) { 
+            while ((obj = stack->pop()) != NULL) { 
+                size_t top = stack->size();
+                obj->mark(this); // push referenced objects to the mark stack
+                stack->reverse(top);
+                if (nIdleMarkers != 0 && stack->size() > 1) { // some thread has no work: share part of ours
+                    shareMarkWork(stack);
+                }
+            }
+            batch = 0;
+            packet = NULL;
+            if (!getMarkWork(batch, packet)) { 
+                break;
+            }
+            if (packet != NULL) { 
+                if (packet->grey) { 
+                    for (size_t i = 0; i < packet->nRefs; i++) { 
+                        if (!stack->push(packet->refs[i])) { 
+                            markStackOverflow = true;
+                        }
+                    }
+                } else { 
+                    for (size_t i = 0; i < packet->nRefs; i++) { 
+                        _mark(packet->refs[i]);
+                    }
+                }
+                CriticalSection cs(markMutex);
+                packet->next = freeMarkPackets;
+                freeMarkPackets = packet;
+            } else { 
+                for (size_t i = batch, end = batch + ROOT_BATCH < nRoots ? batch + ROOT_BATCH : nRoots; i < end; i++) { 
+                    if (rootStack[i] != NULL) { 
+                        rootStack[i]->mark(this);
+                    }
+                }
+            }
+        }
+    }
+
+    void MemoryAllocator::markPhase() 
+    {
+        clearMarks();
+        markRoots();
+    }
+
+    void MemoryAllocator::markRoots() 
+    {
+        weakReferences = LAST_WEAK_REF;
+        marking = true;
+        setTracing(true);
+        if (nMarkThreads > 1) { 
+            markMutex.lock();
+            nextRoot = 0;
+            nIdleMarkers = 0;
+            markingDone = false;
+            parallelMarking = true;
+            nActiveHelpers = nMarkThreads-1;
+            markCycle += 1;
+            markEvent.signal();
+            markMutex.unlock();
+
+            markStackCtx.set(&markStack);
+            parallelMark(&markStack);
+
+            markMutex.lock();
+            while (nActiveHelpers != 0) { 
+                markEvent.wait(markMutex);
+            }
+            parallelMarking = false;
+            markMutex.unlock();
+        } else { 
+            for (size_t i = 0; i < nRoots; i++) { 
+                if (rootStack[i] != NULL) { 
+                    rootStack[i]->mark(this); 
+                    traceReferences();
+                }
+            }
+        }
+        markIncoming(this);
+        traceReferences();
+    }
+
+    void MemoryAllocator::startIncrementalMarking()
+    {
+        _finishSweep();
+        clearMarks();
+        weakReferences = LAST_WEAK_REF;
+        marking = true;
+        setTracing(true);
+        for (size_t i = 0; i < nRoots; i++) { // snapshot of roots: just make them grey
+            if (rootStack[i] != NULL) { 
+                rootStack[i]->mark(this); 
+            }
+        }
+        markIncoming(this);
+        setTracing(false);
+        incrementalMarking = true;
+        atomicAdd(&nIncrementalMarkers, 1);
+        nextMarkSlice = allocated + markSliceStep;
+    }
+
+    bool MemoryAllocator::markSlice(size_t budget)
+    {
+        Object* obj;
+        setTracing(true);
+        while (budget != 0 && (obj = markStack.pop()) != NULL) { 
+            size_t top = markStack.size();
+            obj->mark(this);
+            markStack.reverse(top);
+            budget -= 1;
+        }
+        setTracing(false);
+        return markStack.size() == 0;
+    }
+
+    bool MemoryAllocator::sweepSlice(size_t budget)
+    {
+        MemoryPage* page;
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            SizeClass* sc = &classes[i];
+            while ((page = takeUnsweptPage(sc)) != NULL) { 
+                size_t nSlots = page->nSlots;
+                sweepPage(sc, page);
+                if (budget <= nSlots) { 
+                    return false;
+                }
+                budget -= nSlots;
+            }
+        }
+        while ((page = takeUnsweptPage(NULL)) != NULL) { 
+            sweepLargePage(page);
+            if (--budget == 0) { 
+                return false;
+            }
+        }
+        while ((page = takeUnsweptBlock()) != NULL) { 
+            sweepBlock(page);
+            if (budget <= MemoryPage::N_LINES) { 
+                return false;
+            }
+            budget -= MemoryPage::N_LINES;
+        }
+        CriticalSection cs(sweepMutex);
+        return nPagesInSweep == 0; // wait until sweeper thread completes its pages
+    }
+
+    void MemoryAllocator::finishMarkPhase()
+    {
+        setTracing(true);
+        if (incrementalMarking) { // objects which became referenced from other heaps during incremental marking
+            markIncoming(this);
+        }
+        traceReferences(); // grey objects left by incremental marking
+        rescanMarkedObjects();
+        setTracing(false);
+        marking = false;
+        if (incrementalMarking) { 
+            incrementalMarking = false;
+            atomicAdd(&nIncrementalMarkers, (size_t)-1);
+        }
+        resetWeakReferences(weakReferences);
+        weakReferences = LAST_WEAK_REF;
+    }
+
+    void MemoryAllocator::resetWeakReferences(AnyWeakRef* list)
+    {
+        AnyWeakRef *wref, *next;
+        for (wref = list; wref != LAST_WEAK_REF; wref = next) { 
+            next = wref->next;
+            wref->next = NULL;
+            if (wref->obj != NULL && !MemoryPage::isMarked(wref->obj)) { 
+                wref->obj = NULL;
+            }
+        }
+    }
+    
+    MemoryPage* MemoryAllocator::takeUnsweptPage(SizeClass* sc)
+    {
+        CriticalSection cs(sweepMutex);
+        MemoryPage** list = sc != NULL ? &sc->unswept : &unsweptLargePages;
+        MemoryPage* page = *list;
+        if (page != NULL) { 
+            *list = page->next;
+            nPagesInSweep += 1;
+        }
+        return page;
+    }
+
+    void MemoryAllocator::sweepPage(SizeClass* sc, MemoryPage* page)
+    {
+        size_t const* bitmap = page->markBits;
+        size_t nLive = 0, nPending = 0;
+        for (size_t i = 0; i < MemoryPage::BITMAP_WORDS; i++) { 
+            nLive += popcount(bitmap[i]);
+        }
+        ObjectHeader *first = NULL, *last = NULL;
+        ObjectHeader *firstZombie = NULL, *lastZombie = NULL;
+        ObjectHeader *firstFinalizable = NULL, *lastFinalizable = NULL;
+        if (nLive != page->nSlots && page->nFinalizable == 0) { 
+            // No object of the page needs destruction: free slots are located using only mark bitmap
+            size_t step = page->slotSize / MemoryPage::GRANULE;
+            size_t bit = MemoryPage::getBitIndex(page->getSlot(0)->getObject());
+            for (size_t i = 0, n = page->nSlots; i < n; i++, bit += step) { 
+                if (!((bitmap[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1)) { 
+                    ObjectHeader* hdr = page->getSlot(i);
+                    if (last != NULL) { 
+                        last->next = (ObjectHeader*)((size_t)hdr | FREE_SLOT);
+                    } else { 
+                        first = hdr;
+                    }
+                    last = hdr;
+                }
+            }
+        } else if (nLive != page->nSlots) { // if all objects are alive there is no need to visit slots
+            size_t word = 0, wordIndex = (size_t)-1;
+            for (size_t i = 0, n = page->nSlots; i < n; i++) { 
+                ObjectHeader* hdr = page->getSlot(i);
+                size_t bit = MemoryPage::getBitIndex(hdr->getObject());
+                if (bit / BITS_PER_WORD != wordIndex) { 
+                    wordIndex = bit / BITS_PER_WORD;
+                    word = bitmap[wordIndex];
+                }
+                if ((word >> (bit % BITS_PER_WORD)) & 1) { // live object
+                    continue;
+                }
+                size_t flags = (size_t)hdr->next;
+                if (flags & FINALIZATION_PENDING) { // slot is released after finalization
+                    nPending += 1;
+                    continue;
+                }
+                if (!(flags & FREE_SLOT)) { 
+                    if (flags & ObjectHeader::OWNER_THREAD) { // leave it to the owner thread
+                        addPending(firstZombie, lastZombie, hdr);
+                        continue;
+                    }
+                    if (flags & ObjectHeader::FINALIZABLE) { 
+                        addPending(firstFinalizable, lastFinalizable, hdr);
+                        continue;
+                    }
+                }
+                if (last != NULL) { 
+                    last->next = (ObjectHeader*)((size_t)hdr | FREE_SLOT);
+                } else { 
+                    first = hdr;
+                }
+                last = hdr;
+            }
+        }
+        bool empty = nLive == 0 && nPending == 0 && firstZombie == NULL && firstFinalizable == NULL;
+        if (empty) { 
+            freePage(page);
+        } else { 
+            page->freeList = first;
+            page->freeTail = last;
+        }
+        CriticalSection cs(sweepMutex);
+        if (!empty) { // free slots will be moved to free list of size class by owner thread
+            page->next = sc->swept;
+            sc->swept = page;
+        }
+        enqueueFinalization(firstFinalizable, lastFinalizable, firstZombie, lastZombie);
+        if (--nPagesInSweep == 0) { 
+            sweepEvent.signal();
+        }
+    }
+
+    void MemoryAllocator::sweepLargePage(MemoryPage* page)
+    {
+        ObjectHeader* hdr = page->getSlot(0);
+        bool live = MemoryPage::isMarked(hdr->getObject());
+        size_t flags = (size_t)hdr->next;
+        bool zombie = !live && (flags & (ObjectHeader::OWNER_THREAD|FREE_SLOT)) == ObjectHeader::OWNER_THREAD;
+        bool finalizable = !live && !zombie && (flags & (ObjectHeader::FINALIZABLE|FREE_SLOT)) == ObjectHeader::FINALIZABLE;
+        if (!live && !zombie && !finalizable) { 
+            freePage(page);
+        }
+        CriticalSection cs(sweepMutex);
+        if (live) { 
+            page->next = largePages;
+            largePages = page;
+        } else if (zombie) { // page will be released after object destruction
+            enqueueFinalization(NULL, NULL, hdr, hdr);
+        } else if (finalizable) { 
+            enqueueFinalization(hdr, hdr, NULL, NULL);
+        }
+        if (--nPagesInSweep == 0) { 
+            sweepEvent.signal();
+        }
+    }
+
+    void MemoryAllocator::sweepLargePages()
+    {
+        MemoryPage* page;
+        while ((page = takeUnsweptPage(NULL)) != NULL) { 
+            sweepLargePage(page);
+        }
+    }
+
+    MemoryPage* MemoryAllocator::takeUnsweptBlock()
+    {
+        CriticalSection cs(sweepMutex);
+        MemoryPage* page = unsweptBlocks;
+        if (page != NULL) { 
+            unsweptBlocks = page->next;
+            nPagesInSweep += 1;
+        }
+        return page;
+    }
+
+    void MemoryAllocator::sweepBlock(MemoryPage* page)
+    {
+        size_t const* bitmap = page->markBits;
+        size_t nLiveLines = 0, nFreeLines = 0;
+        bool prevUsed = false;
+        for (size_t line = FIRST_LINE; line < MemoryPage::N_LINES; line++) { 
+            size_t bit = line*MemoryPage::LINE_GRANULES;
+            bool used = ((bitmap[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & (((size_t)1 << MemoryPage::LINE_GRANULES) - 1)) != 0;
+            page->lines[line] = used || prevUsed; // object starting in previous line may span this line
+            nFreeLines += !page->lines[line];
+            nLiveLines += used;
+            prevUsed = used;
+        }
+        size_t nPending = page->nPending; // free lines may contain objects waiting for finalization
+        bool empty = nLiveLines == 0 && nPending == 0;
+        if (empty) { 
+            freePage(page);
+        }
+        CriticalSection cs(sweepMutex);
+        if (!empty) { 
+            if (nFreeLines != 0 && nPending == 0) { 
+                page->next = recyclableBlocks;
+                recyclableBlocks = page;
+            } else { 
+                page->next = blocks;
+                blocks = page;
+            }
+        }
+        if (--nPagesInSweep == 0) { 
+            sweepEvent.signal();
+        }
+    }
+
+    void MemoryAllocator::sweepBlocks()
+    {
+        MemoryPage* page;
+        while ((page = takeUnsweptBlock()) != NULL) { 
+            sweepBlock(page);
+        }
+    }
+
+    bool MemoryAllocator::refillFreeList(SizeClass* sc)
+    {
+        sweepMutex.lock();
+        MemoryPage* page = sc->swept;
+        sc->swept = NULL;
+        sweepMutex.unlock();
+        if (page == NULL) { 
+            return false;
+        }
+        MemoryPage* next;
+        for (; page != NULL; page = next) { 
+            next = page->next;
+            if (page->freeList != NULL) { // prepend free slots of the page to free list of size class
+                page->freeTail->next = (ObjectHeader*)((size_t)sc->freeList | FREE_SLOT);
+                sc->freeList = page->freeList;
+                page->freeList = NULL;
+            }
+            page->next = sc->pages;
+            sc->pages = page;
+        }
+        return true;
+    }
+
+    SizeClass* MemoryAllocator::getSizeClass(MemoryPage* page)
+    {
+        size_t i = sizeClassMap.index[page->slotSize >> 4];
+        return &classes[page->pointerFree ? MemoryPage::N_SIZE_CLASSES + i : i];
+    }
+
+    void MemoryAllocator::enqueueFinalization(ObjectHeader* first, ObjectHeader* last, ObjectHeader* firstZombie, ObjectHeader* lastZombie)
+    {
+        // Caller should hold sweepMutex
+        if (first != NULL) { 
+            last->next = (ObjectHeader*)((size_t)finalizationQueue | FINALIZATION_PENDING);
+            finalizationQueue = first;
+            if (finalizer != NULL) { 
+                finalizeEvent.signal();
+            }
+        }
+        if (firstZombie != NULL) { 
+            lastZombie->next = (ObjectHeader*)((size_t)zombies | FINALIZATION_PENDING);
+            zombies = firstZombie;
+        }
+    }
+
+    size_t MemoryAllocator::finalizeObjects(ObjectHeader* volatile* queue, size_t maxObjects, bool owner)
+    {
+        sweepMutex.lock();
+        ObjectHeader* hdr = *queue;
+        *queue = NULL;
+        sweepMutex.unlock();
+
+        ObjectHeader* next;
+        size_t n;
+        for (n = 0; hdr != NULL && n < maxObjects; hdr = next, n++) { 
+            next = (ObjectHeader*)((size_t)hdr->next & ~FINALIZATION_PENDING);
+            MemoryPage* page = MemoryPage::getPage(hdr->getObject());
+            hdr->getObject()->~Object();
+            if (page->region) { // lines of the block will be reclaimed by next sweep
+                atomicAdd(&page->nPending, (size_t)-1);
+            } else if (page->slotSize > MemoryPage::MAX_SMALL_SIZE) { 
+                freePage(page);
+            } else if (owner && !sweepPending) { // no page will be swept before next GC: slot can be reused immediately
+                SizeClass* sc = getSizeClass(page);
+                hdr->next = (ObjectHeader*)((size_t)sc->freeList | FREE_SLOT);
+                sc->freeList = hdr;
+                atomicAdd(&page->nFinalizable, (size_t)-1);
+            } else { // slot will be included in free list by sweep of the page
+                hdr->next = (ObjectHeader*)FREE_SLOT;
+                atomicAdd(&page->nFinalizable, (size_t)-1);
+            }
+        }
+        if (hdr != NULL) { // return the rest of objects to the queue
+            ObjectHeader* last = hdr;
+            while ((next = (ObjectHeader*)((size_t)last->next & ~FINALIZATION_PENDING)) != NULL) { 
+                last = next;
+            }
+            CriticalSection cs(sweepMutex);
+            last->next = (ObjectHeader*)((size_t)*queue | FINALIZATION_PENDING);
+            *queue = hdr;
+        }
+        return n;
     }
-    
+
+    void MemoryAllocator::processZombies()
+    {
+        finalizeObjects(&zombies, (size_t)-1, true);
+    }
+
+    size_t MemoryAllocator::_runFinalizers(size_t maxObjects)
+    {
+        size_t n = finalizeObjects(&zombies, maxObjects, true);
+        return n + finalizeObjects(&finalizationQueue, maxObjects - n, true);
+    }
+
+    void MemoryAllocator::_finishSweep()
+    {
+        if (sweepPending) { 
+            MemoryPage* page;
+            for (size_t i = 0; i < N_CLASSES; i++) { 
+                SizeClass* sc = &classes[i];
+                while ((page = takeUnsweptPage(sc)) != NULL) { 
+                    sweepPage(sc, page);
+                }
+            }
+            sweepLargePages();
+            sweepBlocks();
+
+            // Wait completion of pages taken by sweeper thread
+            sweepMutex.lock();
+            while (nPagesInSweep != 0) { 
+                sweepEvent.wait(sweepMutex);
+            }
+            sweepMutex.unlock();
+
+            for (size_t i = 0; i < N_CLASSES; i++) { 
+                if (classes[i].swept != NULL) { // no more concurrent updates of this list
+                    refillFreeList(&classes[i]);
+                }
+            }
+            sweepPending = false;
+        }
+    }
+
+    void MemoryAllocator::checkFinalizableObjects()
+    {
+        // Objects of blocks are not visited by sweep: unreachable objects requested finalization are found among registered ones
+        ObjectHeader *firstZombie = NULL, *lastZombie = NULL;
+        ObjectHeader *firstFinalizable = NULL, *lastFinalizable = NULL;
+        size_t n = finalizableObjects.size(), j = 0;
+        for (size_t i = 0; i < n; i++) { 
+            Object* obj = finalizableObjects.at(i);
+            ObjectHeader* hdr = (ObjectHeader*)obj - 1;
+            size_t flags = (size_t)hdr->next;
+            if (MemoryPage::isMarked(obj)) { 
+                finalizableObjects.at(j++) = obj;
+            } else if (!(flags & FREE_SLOT)) { // otherwise construction of object was failed
+                atomicAdd(&MemoryPage::getPage(obj)->nPending, 1);
+                if (flags & ObjectHeader::OWNER_THREAD) { 
+                    addPending(firstZombie, lastZombie, hdr);
+                } else { 
+                    addPending(firstFinalizable, lastFinalizable, hdr);
+                }
+            }
+        }
+        finalizableObjects.truncate(j);
+        CriticalSection cs(sweepMutex);
+        enqueueFinalization(firstFinalizable, lastFinalizable, firstZombie, lastZombie);
+    }
+
     void MemoryAllocator::sweepPhase() 
     {
-        ObjectHeader *op, **opp = &objects; 
-        while ((op = *opp) != NULL) { 
-            size_t next = (size_t)op->next;
-            if (next & BLACK_MARK) { 
-                op->next = (ObjectHeader*)(next - BLACK_MARK);
-                opp = &op->next;
-            } else { 
-                *opp = (ObjectHeader*)next;
-                delete op->getObject();
+        // All pages become unswept, live size is calculated using their mark bitmaps
+        size_t live = 0, capacity = 0;
+        MemoryPage* page;
+        if (finalizableObjects.size() != 0) { 
+            checkFinalizableObjects();
+        }
+        purgeOutgoing(); // objects of other heaps which references were not found by mark phase may be reclaimed by their owners
+        sweepMutex.lock();
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            SizeClass* sc = &classes[i];
+            for (page = sc->pages; page != NULL; page = page->next) { 
+                size_t nLive = 0;
+                for (size_t j = 0; j < MemoryPage::BITMAP_WORDS; j++) { 
+                    nLive += popcount(page->markBits[j]);
+                }
+                live += nLive*page->slotSize;
+                capacity += page->nSlots*page->slotSize;
+            }
+            sc->freeList = NULL;
+            sc->unswept = sc->pages;
+            sc->pages = NULL;
+        }
+        size_t free = capacity - live; // free space in pages of size classes
+        compactionPending = compactionThreshold != 0 && nurserySize == 0 
+            && free > capacity / 100 * compactionThreshold && free > MemoryPage::N_SIZE_CLASSES*MemoryPage::PAGE_SIZE;
+        for (page = largePages; page != NULL; page = page->next) { 
+            if (MemoryPage::isMarked(page->getSlot(0)->getObject())) { 
+                live += page->slotSize;
+            }
+        }
+        unsweptLargePages = largePages;
+        largePages = NULL;
+        MemoryPage** tail = &unsweptBlocks;
+        MemoryPage* blockLists[] = { blocks, recyclableBlocks };
+        for (size_t i = 0; i < 2; i++) { 
+            for (page = blockLists[i]; page != NULL; page = page->next) { 
+                for (size_t j = 0; j < MemoryPage::BITMAP_WORDS; j++) { // live size is estimated by number of lines with marked objects
+                    size_t word = page->markBits[j];
+                    for (size_t k = 0; k < BITS_PER_WORD; k += MemoryPage::LINE_GRANULES) { 
+                        if ((word >> k) & (((size_t)1 << MemoryPage::LINE_GRANULES) - 1)) { 
+                            live += MemoryPage::LINE_SIZE;
+                        }
+                    }
+                }
+                *tail = page;
+                tail = &page->next;
             }
         }
+        *tail = NULL;
+        blocks = recyclableBlocks = NULL;
+        currentBlock = NULL;
+        regionCursor = regionLimit = NULL;
+        sweepCycle += 1;
+        sweepEvent.signal(); // wakeup sweeper thread
+        sweepMutex.unlock();
+        sweepPending = true;
         allocated = 0;
+        nurseryStart = 0;
+        liveObjectsSize = live;
+        adjustThresholds();
+
+        if (!lazySweep && sweeper == NULL) { 
+            _finishSweep();
+        }
+        decayFreePages();
+    }
+
+    void MemoryAllocator::_compact()
+    {
+        compactionPending = false;
+        if (nurserySize != 0 || heap != NULL) { // old bits of pages are used by generational mode, objects of shared heap are referenced by other threads
+            _gc();
+            return;
+        }
+        if (incrementalMarking) { // marking is restarted to find pinned objects
+            finishMarkPhase();
+        }
+        _finishSweep();
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            for (MemoryPage* page = classes[i].pages; page != NULL; page = page->next) { 
+                memset(page->oldBits, 0, sizeof(page->oldBits));
+            }
+        }
+        pinning = true;
+        markPhase();
+        finishMarkPhase();
+        pinning = false;
+
+        computeForwardingAddresses();
+        updateReferences();
+        moveObjects();
+
+        sweepPhase(); // release pages emptied by compaction
+    }
+
+    bool MemoryAllocator::isPinned(MemoryPage* page, ObjectHeader* hdr) const
+    {
+        size_t bit = MemoryPage::getBitIndex(hdr->getObject());
+        return ((page->oldBits[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1) 
+            || ((size_t)hdr->next & ObjectHeader::OWNER_THREAD); // object may be referenced by Var<T> members
+    }
+
+    bool MemoryAllocator::isOccupied(MemoryPage* page, ObjectHeader* hdr) const
+    {
+        if (MemoryPage::isMarked(hdr->getObject())) { // slot of movable object is either already assigned or released
+            return isPinned(page, hdr);
+        }
+        // Unreachable objects waiting for destruction are left in place
+        size_t flags = (size_t)hdr->next;
+        return (flags & FINALIZATION_PENDING) 
+            || (!(flags & FREE_SLOT) && (flags & (ObjectHeader::OWNER_THREAD|ObjectHeader::FINALIZABLE)));
+    }
+
+    Object* MemoryAllocator::forward(Object* obj) const
+    {
+        MemoryPage* page = MemoryPage::getPage(obj);
+        ObjectHeader* hdr = (ObjectHeader*)obj - 1;
+        if (!isMovable(page, this) || !MemoryPage::isMarked(obj) || isPinned(page, hdr)) { 
+            return obj;
+        }
+        return ((ObjectHeader*)((size_t)hdr->next & ~(MemoryPage::GRANULE - 1)))->getObject();
+    }
+
+    void MemoryAllocator::updateRef(Object** ref)
+    {
+        if (*ref != NULL) { 
+            *ref = forward(*ref);
+        }
+    }
+
+    void MemoryAllocator::computeForwardingAddresses()
+    {
+        // Live objects of each size class are slided to the free slots preceding them in the list of pages.
+        // Forwarding address is stored in object header, preserving FINALIZABLE flag.
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            MemoryPage* dstPage = classes[i].pages;
+            size_t dstSlot = 0;
+            for (MemoryPage* page = classes[i].pages; page != NULL; page = page->next) { 
+                for (size_t j = 0, n = page->nSlots; j < n; j++) { 
+                    ObjectHeader* hdr = page->getSlot(j);
+                    if (!MemoryPage::isMarked(hdr->getObject()) || isPinned(page, hdr)) { 
+                        continue;
+                    }
+                    // Destination never follows the object, so the search is always terminated
+                    ObjectHeader* dst;
+                    while (isOccupied(dstPage, dst = dstPage->getSlot(dstSlot))) { 
+                        if (++dstSlot == dstPage->nSlots) { 
+                            dstPage = dstPage->next;
+                            dstSlot = 0;
+                        }
+                    }
+                    hdr->next = (ObjectHeader*)((size_t)dst | ((size_t)hdr->next & ObjectHeader::FINALIZABLE));
+                    if (++dstSlot == dstPage->nSlots) { 
+                        dstPage = dstPage->next;
+                        dstSlot = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    void MemoryAllocator::updateReferences()
+    {
+        // Traverse references of all live objects once: mark() methods replace them with forwarding addresses
+        compacting = true;
+        setTracing(true);
+        for (size_t i = 0; i < nRoots; i++) { 
+            if (rootStack[i] != NULL) { 
+                rootStack[i]->mark(this);
+            }
+        }
+        for (size_t i = 0; i < MemoryPage::N_SIZE_CLASSES; i++) { // pointer-free objects have no references
+            for (MemoryPage* page = classes[i].pages; page != NULL; page = page->next) { 
+                for (size_t j = 0, n = page->nSlots; j < n; j++) { 
+                    Object* obj = page->getSlot(j)->getObject();
+                    if (MemoryPage::isMarked(obj)) { 
+                        obj->mark(this);
+                    }
+                }
+            }
+        }
+        for (MemoryPage* page = largePages; page != NULL; page = page->next) { 
+            Object* obj = page->getSlot(0)->getObject();
+            if (!page->pointerFree && MemoryPage::isMarked(obj)) { 
+                obj->mark(this);
+            }
+        }
+        for (MemoryPage* page = blocks; page != NULL; page = page->next) { 
+            traceBlockObjects(page, 0, MemoryPage::PAGE_SIZE/MemoryPage::GRANULE, false);
+        }
+        for (MemoryPage* page = recyclableBlocks; page != NULL; page = page->next) { 
+            traceBlockObjects(page, 0, MemoryPage::PAGE_SIZE/MemoryPage::GRANULE, false);
+        }
+        setTracing(false);
+        compacting = false;
+    }
+
+    void MemoryAllocator::moveObjects()
+    {
+        // Objects are moved in the same order as forwarding addresses were assigned,
+        // so destination slot is either free or its object is already moved
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            for (MemoryPage* page = classes[i].pages; page != NULL; page = page->next) { 
+                for (size_t j = 0, n = page->nSlots; j < n; j++) { 
+                    ObjectHeader* hdr = page->getSlot(j);
+                    Object* obj = hdr->getObject();
+                    if (!MemoryPage::isMarked(obj) || isPinned(page, hdr)) { 
+                        continue;
+                    }
+                    ObjectHeader* dst = (ObjectHeader*)((size_t)hdr->next & ~(MemoryPage::GRANULE - 1));
+                    size_t flags = (size_t)hdr->next & ObjectHeader::FINALIZABLE;
+                    if (dst != hdr) { 
+                        memcpy((void*)dst->getObject(), (void*)obj, page->slotSize - sizeof(ObjectHeader));
+                        size_t bit = MemoryPage::getBitIndex(obj);
+                        page->markBits[bit / BITS_PER_WORD] &= ~((size_t)1 << (bit % BITS_PER_WORD));
+                        MemoryPage* dstPage = MemoryPage::getPage(dst->getObject());
+                        bit = MemoryPage::getBitIndex(dst->getObject());
+                        dstPage->markBits[bit / BITS_PER_WORD] |= (size_t)1 << (bit % BITS_PER_WORD);
+                        hdr->next = (ObjectHeader*)FREE_SLOT;
+                        if (flags != 0 && dstPage != page) { 
+                            atomicAdd(&page->nFinalizable, (size_t)-1);
+                            atomicAdd(&dstPage->nFinalizable, 1);
+                        }
+                    }
+                    dst->next = (ObjectHeader*)flags;
+                }
+                memset(page->oldBits, 0, sizeof(page->oldBits));
+            }
+        }
+    }
+
+    void MemoryAllocator::remember(void const* field)
+    {
+        MemoryPage* page = PageMap::find(field);
+        if (page != NULL) { // reference is located in garbage collected heap
+            markCard(page, field);
+        }
+    }
+
+    void MemoryAllocator::markCard(MemoryPage* page, void const* addr)
+    {
+        // Large object is always scanned as a whole, so it is enough to have single card for it
+        size_t card = page->slotSize > MemoryPage::MAX_SMALL_SIZE ? 0 : ((size_t)addr & (MemoryPage::PAGE_SIZE-1)) / MemoryPage::CARD_SIZE;
+        page->cards[card] = 1;
+        if (!page->dirty && atomicExchange(&page->dirty, 1) == 0) { // page is not yet included in the list of dirty pages
+            MemoryAllocator* owner = page->owner;
+            MemoryPage* head;
+            do { 
+                head = owner->dirtyPages;
+                page->nextDirty = head;
+            } while (!atomicCompareAndSwap((void* volatile*)&owner->dirtyPages, head, page));
+        }
+    }
+
+    /**
+     * Detach list of dirty pages of the allocator
+     */
+    static MemoryPage* takeDirtyPages(MemoryPage* volatile* list)
+    {
+        MemoryPage* head;
+        do { 
+            head = *list;
+        } while (head != NULL && !atomicCompareAndSwap((void* volatile*)list, head, NULL));
+        return head;
+    }
+
+    void MemoryAllocator::scanDirtyCards()
+    {
+        MemoryPage* next;
+        for (MemoryPage* page = takeDirtyPages(&dirtyPages); page != NULL; page = next) { 
+            next = page->nextDirty;
+            page->dirty = false; // cards which are still referencing young objects will be marked again by updateRememberedSet()
+            size_t lastSlot = (size_t)-1;
+            for (size_t card = 0; card < MemoryPage::N_CARDS; card++) { 
+                if (!page->cards[card]) { 
+                    continue;
+                }
+                page->cards[card] = 0;
+                if (page->region) { // objects starting in previous line may overlap with the card
+                    size_t start = card*MemoryPage::CARD_SIZE;
+                    size_t from = start > MemoryPage::LINE_SIZE ? (start - MemoryPage::LINE_SIZE) / MemoryPage::GRANULE : 0;
+                    if (lastSlot != (size_t)-1 && from < lastSlot) { // objects were already scanned for previous card
+                        from = lastSlot;
+                    }
+                    lastSlot = (start + MemoryPage::CARD_SIZE) / MemoryPage::GRANULE;
+                    traceBlockObjects(page, from, lastSlot, true);
+                    continue;
+                }
+                size_t from, till; // range of slots overlapping with the card
+                if (page->slotSize > MemoryPage::MAX_SMALL_SIZE) { 
+                    from = till = 0;
+                } else { 
+                    size_t start = card*MemoryPage::CARD_SIZE;
+                    size_t end = start + MemoryPage::CARD_SIZE;
+                    if (end <= sizeof(MemoryPage)) { // card contains only page header
+                        continue;
+                    }
+                    from = start > sizeof(MemoryPage) ? (start - sizeof(MemoryPage)) / page->slotSize : 0;
+                    till = (end - 1 - sizeof(MemoryPage)) / page->slotSize;
+                    if (till >= page->nSlots) { 
+                        till = page->nSlots - 1;
+                    }
+                    if (lastSlot != (size_t)-1 && from <= lastSlot) { // slot was already scanned for previous card
+                        from = lastSlot + 1;
+                    }
+                }
+                for (size_t i = from; i <= till; i++) { 
+                    Object* obj = page->getSlot(i)->getObject();
+                    if (MemoryPage::isMarked(obj)) { // only old objects can be source of old-to-young references
+                        obj->mark(this);
+                        traceReferences();
+                        if (!rememberedObjects.push(obj)) { 
+                            markCard(page, obj);
+                        }
+                    }
+                }
+                lastSlot = till;
+            }
+        }
+    }
+
+    bool MemoryAllocator::promote(ObjectHeader* hdr)
+    {
+        size_t flags = (size_t)hdr->next;
+        size_t age = (flags >> ObjectHeader::AGE_SHIFT) + 1;
+        if (age >= promotionAge) { 
+            return true;
+        }
+        hdr->next = (ObjectHeader*)((age << ObjectHeader::AGE_SHIFT) | (flags & ((1 << ObjectHeader::AGE_SHIFT) - 1)));
+        return false;
+    }
+
+    void MemoryAllocator::minorSweep()
+    {
+        MemoryPage** pp = &youngPages;
+        MemoryPage* page;
+        ObjectHeader *firstZombie = NULL, *lastZombie = NULL;
+        ObjectHeader *firstFinalizable = NULL, *lastFinalizable = NULL;
+        while ((page = *pp) != NULL) { 
+            if (page->slotSize > MemoryPage::MAX_SMALL_SIZE) { 
+                ObjectHeader* hdr = page->getSlot(0);
+                size_t bit = MemoryPage::getBitIndex(hdr->getObject());
+                if (MemoryPage::isMarked(hdr->getObject())) { 
+                    bool old = (page->oldBits[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1; // allocated during incremental marking
+                    if (old || promote(hdr)) { 
+                        if (!old && !rememberedObjects.push(hdr->getObject())) { 
+                            markCard(page, hdr->getObject());
+                        }
+                        page->young = false;
+                        *pp = page->nextYoung;
+                        CriticalSection cs(sweepMutex);
+                        page->next = largePages;
+                        largePages = page;
+                        continue;
+                    } 
+                    page->markBits[bit / BITS_PER_WORD] &= ~((size_t)1 << (bit % BITS_PER_WORD)); // object remains young
+                    pp = &page->nextYoung;
+                    continue;
+                }
+                *pp = page->nextYoung;
+                allocated -= allocated > page->slotSize ? page->slotSize : allocated;
+                page->young = false;
+                size_t flags = (size_t)hdr->next;
+                if (flags & FREE_SLOT) { 
+                    freePage(page);
+                } else if (flags & ObjectHeader::OWNER_THREAD) { // page will be released after object destruction
+                    addPending(firstZombie, lastZombie, hdr);
+                } else if (flags & ObjectHeader::FINALIZABLE) { 
+                    addPending(firstFinalizable, lastFinalizable, hdr);
+                } else { 
+                    freePage(page);
+                }
+                continue;
+            }
+            SizeClass* sc = getSizeClass(page);
+            bool young = false;
+            for (size_t i = 0, n = page->nSlots; i < n; i++) { 
+                ObjectHeader* hdr = page->getSlot(i);
+                size_t bit = MemoryPage::getBitIndex(hdr->getObject());
+                size_t mask = (size_t)1 << (bit % BITS_PER_WORD);
+                size_t w = bit / BITS_PER_WORD;
+                if (page->oldBits[w] & mask) { // old object
+                    continue;
+                }
+                if (page->markBits[w] & mask) { // young object survived minor GC
+                    if (promote(hdr)) { 
+                        if (!rememberedObjects.push(hdr->getObject())) { 
+                            markCard(page, hdr->getObject());
+                        }
+                    } else { 
+                        page->markBits[w] &= ~mask;
+                        young = true;
+                    }
+                } else if (!((size_t)hdr->next & (FREE_SLOT|FINALIZATION_PENDING))) { // unreachable young object
+                    size_t flags = (size_t)hdr->next;
+                    if (flags & ObjectHeader::OWNER_THREAD) { 
+                        addPending(firstZombie, lastZombie, hdr);
+                    } else if (flags & ObjectHeader::FINALIZABLE) { 
+                        addPending(firstFinalizable, lastFinalizable, hdr);
+                    } else { 
+                        hdr->next = (ObjectHeader*)((size_t)sc->freeList | FREE_SLOT);
+                        sc->freeList = hdr;
+                    }
+                    allocated -= allocated > page->slotSize ? page->slotSize : allocated;
+                }
+            }
+            if (young) { 
+                pp = &page->nextYoung;
+            } else { // page will be included in the list again when new object is allocated in it
+                page->young = false;
+                *pp = page->nextYoung;
+            }
+        }
+        CriticalSection cs(sweepMutex);
+        enqueueFinalization(firstFinalizable, lastFinalizable, firstZombie, lastZombie);
+    }
+
+    void MemoryAllocator::updateRememberedSet()
+    {
+        Object* obj;
+        probing = true;
+        setTracing(true);
+        while ((obj = rememberedObjects.pop()) != NULL) { 
+            youngRefFound = false;
+            obj->mark(this);
+            if (youngRefFound) { // keep card dirty until referenced young objects are promoted
+                markCard(MemoryPage::getPage(obj), obj);
+            }
+        }
+        setTracing(false);
+        probing = false;
+    }
+
+    void MemoryAllocator::minorGC()
+    {
+        _finishSweep();
+        for (MemoryPage* page = youngPages; page != NULL; page = page->nextYoung) { 
+            memcpy(page->oldBits, page->markBits, sizeof(page->oldBits));
+        }
+        weakReferences = LAST_WEAK_REF;
+        marking = true;
+        setTracing(true);
+        minorMarking = true;
+        scanDirtyCards();
+        for (size_t i = 0; i < nRoots; i++) { 
+            if (rootStack[i] != NULL) { 
+                rootStack[i]->mark(this); 
+                traceReferences();
+            }
+        }
+        markIncoming(this);
+        traceReferences();
+        finishMarkPhase();
+        minorMarking = false;
+        minorSweep();
+        updateRememberedSet();
+        nurseryStart = allocated;
+        decayFreePages();
+    }
+
+    void MemoryAllocator::setTracing(bool enabled)
+    {
+        if (tracing != enabled) { 
+            tracing = enabled;
+            atomicAdd(&nTracingAllocators, enabled ? 1 : (size_t)-1);
+        }
+    }
+
+    void MemoryAllocator::resetGenerations()
+    {
+        MemoryPage *page, *next;
+        for (page = takeDirtyPages(&dirtyPages); page != NULL; page = next) { 
+            next = page->nextDirty;
+            memset(page->cards, 0, sizeof(page->cards));
+            page->dirty = false;
+        }
+        for (page = youngPages; page != NULL; page = next) { 
+            next = page->nextYoung;
+            page->young = false;
+            if (page->slotSize > MemoryPage::MAX_SMALL_SIZE) { 
+                page->next = largePages;
+                largePages = page;
+            }
+        }
+        youngPages = NULL;
+        while (rememberedObjects.pop() != NULL);
+    }
+
+    void MemoryAllocator::rememberReference(void const* field, Object const* obj)
+    {
+        MemoryPage* page = PageMap::find(field);
+        if (page == NULL) { // reference is not located in garbage collected heap: roots are traced by GC of their thread
+            return;
+        }
+        MemoryAllocator* source = page->owner;
+        MemoryAllocator* owner = MemoryPage::getPage(obj)->owner;
+        if (owner != source && (owner->heap == NULL || owner->heap != source->heap)) { // objects of shared heap are traced by its GC
+            owner->rememberIncoming((Object*)obj, source, UNCONFIRMED_EPOCH); // epoch of the source is not read by other threads
+        }
+    }
+
+    void MemoryAllocator::rememberIncoming(Object* obj, MemoryAllocator* source, size_t epoch)
+    {
+        CriticalSection cs(incomingMutex);
+        incoming.add(obj, source, epoch);
+    }
+
+    void MemoryAllocator::markIncoming(MemoryAllocator* owner)
+    {
+        CriticalSection cs(owner->incomingMutex);
+        for (size_t i = 0, n = owner->incoming.capacity(); i < n; i++) { 
+            Object* obj = owner->incoming.at(i).obj;
+            if (obj != NULL) { 
+                _pin(obj); // references located in other heaps can not be updated by compaction
+            }
+        }
+    }
+
+    void MemoryAllocator::purgeOutgoing()
+    {
+        CriticalSection cs(allocatorsMutex);
+        for (MemoryAllocator* owner = allocators; owner != NULL; owner = owner->nextAllocator) { 
+            if (owner != this) { 
+                CriticalSection ocs(owner->incomingMutex);
+                owner->incoming.purge(this, markEpoch);
+            }
+        }
+    }
+
+    SharedHeap::SharedHeap()
+    {
+        members = NULL;
+        nMembers = 0;
+        nStopped = 0;
+        nBusy = 0;
+        phase = IDLE;
+        collector = NULL;
+        weakReferences = LAST_WEAK_REF;
+    }
+
+    SharedHeap::~SharedHeap()
+    {
+        assert(members == NULL); // all allocators should be detached
+    }
+
+    void MemoryAllocator::setSharedHeap(SharedHeap* sharedHeap)
+    {
+        if (heap != NULL) { 
+            heap->mutex.lock();
+            while (heap->collector != NULL) { // GC is waiting for this thread
+                heap->mutex.unlock();
+                safepoint();
+                heap->mutex.lock();
+            }
+            MemoryAllocator** mpp = &heap->members;
+            while (*mpp != this) { 
+                mpp = &(*mpp)->nextMember;
+            }
+            *mpp = nextMember;
+            heap->nMembers -= 1;
+            heap->mutex.unlock();
+            heap = NULL;
+            nextMember = NULL;
+        }
+        if (sharedHeap != NULL) { 
+            if (incrementalMarking) { // complete incremental marking started before
+                finishMarkPhase();
+                sweepPhase();
+            }
+            CriticalSection cs(sharedHeap->mutex);
+            while (sharedHeap->collector != NULL) { // do not join heap during GC
+                sharedHeap->event.wait(sharedHeap->mutex);
+            }
+            nextMember = sharedHeap->members;
+            sharedHeap->members = this;
+            sharedHeap->nMembers += 1;
+            heap = sharedHeap;
+        }
+    }
+
+    void MemoryAllocator::collectSharedHeap()
+    {
+        SharedHeap* h = heap;
+        MemoryAllocator* member;
+        h->mutex.lock();
+        if (h->collector != NULL) { // GC is already started by other thread: take part in it
+            h->mutex.unlock();
+            safepoint();
+            return;
+        }
+        h->collector = this;
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            if (member != this) { 
+                member->safepointRequested = true;
+            }
+        }
+        h->nStopped += 1;
+        while (h->nStopped != h->nMembers) { 
+            h->event.wait(h->mutex);
+        }
+        // All threads are stopped: threads which are not in safe regions take part in GC, work of others is done by this thread
+        size_t nParticipants = 0;
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            nParticipants += !member->inSafeRegion;
+        }
+        h->weakReferences = LAST_WEAK_REF;
+        h->nBusy = nParticipants;
+        h->phase = SharedHeap::CLEAR_MARKS;
+        h->event.signal();
+        h->mutex.unlock();
+
+        _finishSweep(); // mark bits of the previous GC are still needed by unswept pages
+        clearMarks();
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            if (member->inSafeRegion) { 
+                member->_finishSweep();
+                member->clearMarks();
+            }
+        }
+        endPhase();
+
+        // Mark bits of all pages are cleared: now objects can be marked
+        h->mutex.lock();
+        h->nBusy = nParticipants;
+        h->phase = SharedHeap::MARK;
+        h->event.signal();
+        h->mutex.unlock();
+
+        markRoots();
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            if (member->inSafeRegion) { 
+                for (size_t i = 0; i < member->nRoots; i++) { 
+                    if (member->rootStack[i] != NULL) { 
+                        member->rootStack[i]->mark(this); 
+                        traceReferences();
+                    }
+                }
+                markIncoming(member);
+                traceReferences();
+            }
+        }
+        endPhase();
+
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            if (member->markStackOverflow) { 
+                member->markStackOverflow = false;
+                markStackOverflow = true;
+            }
+        }
+        finishMarkPhase(); // pages of all allocators are rescanned if mark stack of some thread was overflown
+        resetWeakReferences(h->weakReferences);
+        h->weakReferences = LAST_WEAK_REF;
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            if (member->inSafeRegion) { 
+                member->sweepPhase();
+            }
+        }
+
+        // Resume stopped threads: each of them sweeps its own pages
+        h->mutex.lock();
+        for (member = h->members; member != NULL; member = member->nextMember) { 
+            member->safepointRequested = false;
+        }
+        h->nStopped -= nParticipants;
+        h->phase = SharedHeap::IDLE;
+        h->collector = NULL;
+        h->event.signal();
+        h->mutex.unlock();
+        sweepPhase();
+    }
+
+    void MemoryAllocator::safepoint()
+    {
+        SharedHeap* h = heap;
+        h->mutex.lock();
+        if (h->collector == NULL || inSafeRegion) { // GC is already completed
+            h->mutex.unlock();
+            return;
+        }
+        h->nStopped += 1;
+        h->event.signal();
+        while (h->phase != SharedHeap::CLEAR_MARKS) { 
+            h->event.wait(h->mutex);
+        }
+        h->mutex.unlock();
+
+        _finishSweep();
+        clearMarks();
+        endPhase();
+
+        markRoots();
+        setTracing(false);
+        marking = false;
+        endPhase();
+
+        sweepPhase();
+    }
+
+    void MemoryAllocator::endPhase()
+    {
+        SharedHeap* h = heap;
+        CriticalSection cs(h->mutex);
+        SharedHeap::Phase phase = h->phase;
+        if (--h->nBusy == 0) { 
+            h->event.signal();
+        }
+        if (h->collector == this) { // wait until all threads complete this phase
+            while (h->nBusy != 0) { 
+                h->event.wait(h->mutex);
+            }
+        } else { // wait until collector starts next phase
+            while (h->phase == phase) { 
+                h->event.wait(h->mutex);
+            }
+        }
+    }
+
+    void MemoryAllocator::_enterSafeRegion()
+    {
+        if (heap != NULL) { 
+            CriticalSection cs(heap->mutex);
+            inSafeRegion = true;
+            heap->nStopped += 1;
+            heap->event.signal();
+        }
+    }
+
+    void MemoryAllocator::_leaveSafeRegion()
+    {
+        if (heap != NULL) { 
+            CriticalSection cs(heap->mutex);
+            while (heap->collector != NULL) { // objects may be accessed only when GC is completed
+                heap->event.wait(heap->mutex);
+            }
+            inSafeRegion = false;
+            heap->nStopped -= 1;
+        }
+    }
+
+    void MemoryAllocator::_beginParcel()
+    {
+        MemoryAllocator* builder = new MemoryAllocator(startThreshold, autoStartThreshold); // becomes allocator of the current thread
+        builder->parent = this;
+        builder->layout = MARK_REGION; // small objects of all sizes share blocks, so parcel takes few pages
+        builder->largeObjectThreshold = largeObjectThreshold;
+        if (heap != NULL) { // thread is stopped at safepoints of builder, while roots of this allocator are marked by collector
+            _enterSafeRegion();
+            builder->setSharedHeap(heap);
+        }
+    }
+
+    Parcel* MemoryAllocator::_endParcel(Object* root)
+    {
+        if (parent == NULL || nRoots != 0 || (root != NULL && MemoryPage::getPage(root)->owner != this)) { 
+            return NULL; // parcel was not started, its roots are not released or root is not object of the parcel
+        }
+        if (heap != NULL) { 
+            setSharedHeap(NULL);
+            parent->_leaveSafeRegion();
+        }
+        if (incrementalMarking) { 
+            finishMarkPhase();
+            sweepPhase();
+        }
+        stopSweepThread();
+        stopFinalizerThread();
+        stopMarkThreads();
+        _finishSweep();
+        _runFinalizers((size_t)-1); // destructors are invoked by the thread which has created objects
+        resetGenerations(); // young large pages are moved to the list of large pages
+        ctx.set(parent);
+        Parcel* parcel = new Parcel();
+        parcel->builder = this;
+        parcel->root = root;
+        parcel->next = NULL;
+        return parcel;
+    }
+
+    Object* MemoryAllocator::_openParcel(Parcel* parcel)
+    {
+        MemoryAllocator* builder = parcel->builder;
+        Object* root = parcel->root;
+        delete parcel;
+        adopt(builder);
+        delete builder; // releases only cached empty pages of the builder
+        if (incrementalMarking) { // adopted objects are white: trace them from the root
+            _mark(root);
+        }
+        return root;
+    }
+
+    void MemoryAllocator::adoptPage(MemoryPage* page)
+    {
+        page->owner = this;
+        memset(page->markBits, 0, sizeof(page->markBits)); // mark bits of the last GC of the builder
+        if (nurserySize != 0) { // adopted objects are young as if they were just allocated
+            page->young = true;
+            page->nextYoung = youngPages;
+            youngPages = page;
+        }
+    }
+
+    void MemoryAllocator::adopt(MemoryAllocator* donor)
+    {
+        MemoryPage *page, *next;
+        size_t size = 0;
+        sweepMutex.lock(); // lists of pages are also updated by sweeper thread
+        // Donor has no unswept pages and free slots of its pages are reclaimed by the next sweep
+        for (size_t i = 0; i < N_CLASSES; i++) { 
+            for (page = donor->classes[i].pages; page != NULL; page = next) { 
+                next = page->next;
+                size += page->pageSize;
+                adoptPage(page);
+                page->next = classes[i].pages;
+                classes[i].pages = page;
+            }
+            donor->classes[i].pages = NULL;
+            donor->classes[i].freeList = NULL;
+        }
+        for (page = donor->largePages; page != NULL; page = next) { 
+            next = page->next;
+            size += page->pageSize;
+            adoptPage(page);
+            if (nurserySize == 0) { // young large pages are included only in list of young pages
+                page->next = largePages;
+                largePages = page;
+            }
+        }
+        donor->largePages = NULL;
+        MemoryPage** donorBlocks[] = { &donor->blocks, &donor->recyclableBlocks };
+        MemoryPage** ownBlocks[] = { &blocks, &recyclableBlocks };
+        for (size_t i = 0; i < 2; i++) { 
+            for (page = *donorBlocks[i]; page != NULL; page = next) { 
+                next = page->next;
+                size += page->pageSize;
+                page->owner = this;
+                memset(page->markBits, 0, sizeof(page->markBits));
+                page->next = *ownBlocks[i];
+                *ownBlocks[i] = page;
+            }
+            *donorBlocks[i] = NULL;
+        }
+        sweepMutex.unlock();
+        donor->currentBlock = NULL;
+        donor->regionCursor = donor->regionLimit = NULL;
+        Object* obj;
+        while ((obj = donor->finalizableObjects.pop()) != NULL) { 
+            finalizableObjects.push(obj);
+        }
+        allocated += size; // adopted memory is accounted by size of pages: they may be sparsely filled
+
+        // References from objects of the donor to other heaps become references from this heap
+        {
+            CriticalSection cs(allocatorsMutex);
+            for (MemoryAllocator* owner = allocators; owner != NULL; owner = owner->nextAllocator) { 
+                if (owner != donor) { 
+                    CriticalSection ocs(owner->incomingMutex);
+                    owner->incoming.rebind(donor, (size_t)-1, owner != this ? this : NULL, markEpoch);
+                }
+            }
+        }
+        // Objects of the donor referenced from other heaps are now objects of this allocator
+        CriticalSection cs(incomingMutex);
+        CriticalSection dcs(donor->incomingMutex);
+        for (size_t i = 0, n = donor->incoming.capacity(); i < n; i++) { 
+            RememberedSet::Entry const& e = donor->incoming.at(i);
+            if (e.obj != NULL && e.source != this) { 
+                incoming.add(e.obj, e.source, e.epoch);
+            }
+        }
+        donor->incoming.clear();
+    }
+
+    ParcelQueue::ParcelQueue()
+    {
+        incoming = NULL;
+        outgoing = NULL;
+    }
+
+    ParcelQueue::~ParcelQueue()
+    {
+        Parcel* parcel;
+        while ((parcel = get()) != NULL) { 
+            delete parcel->builder;
+            delete parcel;
+        }
+    }
+
+    void ParcelQueue::put(Parcel* parcel)
+    {
+        Parcel* head;
+        do { 
+            head = incoming;
+            parcel->next = head;
+        } while (!atomicCompareAndSwap((void* volatile*)&incoming, head, parcel));
+    }
+
+    Parcel* ParcelQueue::get()
+    {
+        if (outgoing == NULL && incoming != NULL) { 
+            Parcel* list = (Parcel*)atomicExchange((size_t volatile*)&incoming, 0);
+            while (list != NULL) { // reverse LIFO list
+                Parcel* next = list->next;
+                list->next = outgoing;
+                outgoing = list;
+                list = next;
+            }
+        }
+        Parcel* parcel = outgoing;
+        if (parcel != NULL) { 
+            outgoing = parcel->next;
+        }
+        return parcel;
     }
 }
@@ -8,9 +8,11 @@
 
 namespace GC
 {
+    class MemoryAllocator;
     class Object;
     class Root;
     class AnyWeakRef;
+    class Parcel;
 
     /**
      * Invoke copy constructors of Ref<T> class to mark referenced objects
@@ -18,21 +20,361 @@ namespace GC
     #define GC_MARK(Class) Class(*this)
 
     /**
-     * Object header used by allocator to link all allocated objects.
+     * Trace descriptor: alternative to GC_MARK listing reference fields (Ref<T> and WeakRef<T>) of the class.
+     * It defines mark() method which reads only the listed fields and passes them directly to the allocator,
+     * instead of copy constructing temporary object (with all its other members). 
+     * Fields of base classes should be listed too:
+     *
+     *     GC_TRACE_BEGIN(Tree)
+     *         GC_TRACE(left)
+     *         GC_TRACE(right)
+     *     GC_TRACE_END
+     */
+    #define GC_TRACE_BEGIN(Class) virtual void mark(GC::MemoryAllocator* gcAllocator) {
+    #define GC_TRACE(field) GC::trace(gcAllocator, field);
+    #define GC_TRACE_END }
+
+    /**
+     * Object header preceding each object in its memory page slot.
+     * Free slots are linked in the free list of their size class through this header.
      */
     struct ObjectHeader 
     { 
-        ObjectHeader* next;
+        enum { 
+            FINALIZATION_PENDING = 1, // unreachable object is waiting in finalization queue
+            FREE_SLOT    = 2, // slot is not used
+            OWNER_THREAD = 4, // object should be destructed by owner thread (see Object::destructInOwnerThread)
+            FINALIZABLE  = 8, // destructor should be invoked when object becomes unreachable (see Object::requireFinalization)
+            AGE_SHIFT    = 4  // number of minor GCs survived by young object is stored in the rest of header bits
+        };
+        ObjectHeader* next; // next free slot | FREE_SLOT for free slots, age << AGE_SHIFT | OWNER_THREAD | FINALIZABLE for allocated objects,
+                            // next object in the queue | FINALIZATION_PENDING for unreachable objects waiting for finalization
 
         Object* getObject() const { 
             return (Object*)(this + 1);
         }
     };
 
+    /**
+     * Memory page: block of PAGE_SIZE bytes aligned on PAGE_SIZE boundary and carved into slots of the same size class.
+     * Objects larger than MAX_SMALL_SIZE are placed in their own (larger) page containing single slot.
+     * Pages of objects not smaller than large object threshold are directly mapped from OS and unmapped when object is dead.
+     * Standard pages are carved from chunks mapped from OS: empty pages are cached by allocator and decommitted when they are not reused during decay time.
+     * Mark bits are not stored in objects but in bitmap located in page header, 
+     * indexed by object offset within the page in GRANULE units. So marking doesn't modify objects.
+     * In generational mode mark bits are preserved between GCs: marked objects belong to the old generation.
+     * Page is split into cards of CARD_SIZE bytes: card is dirty if it may contain reference from old object to young object.
+     * In mark-region heap layout page is a block of LINE_SIZE lines in which objects of different sizes are allocated by bumping pointer
+     * through ranges of free lines. Objects in such blocks are not larger than line, so line is live if mark bit of some object 
+     * in this line is set, and line following live line is conservatively treated as used (object may span two lines).
+     * Sweep of a block just builds its map of used lines from the mark bitmap.
+     */
+    struct MemoryPage
+    {
+        enum { 
+            PAGE_SIZE = 64*1024,     // size and alignment of standard page
+            MAX_SMALL_SIZE = 8*1024, // maximal size of slot allocated from size class
+            N_SIZE_CLASSES = 32,     // number of size classes
+            GRANULE = 16,            // minimal distance between objects
+            BITMAP_WORDS = PAGE_SIZE/GRANULE/(sizeof(size_t)*8), // size of mark bitmap
+            CARD_SIZE = 512,         // size of card used to track old-to-young references
+            N_CARDS = PAGE_SIZE/CARD_SIZE,
+            LINE_SIZE = 256,         // size of line of block (and maximal size of object allocated in block)
+            N_LINES = PAGE_SIZE/LINE_SIZE,
+            LINE_GRANULES = LINE_SIZE/GRANULE // number of mark bits per line
+        };
+        MemoryPage* next;        // L1 list of pages of the same size class
+        MemoryPage* nextYoung;   // L1 list of pages containing young objects
+        MemoryPage* nextDirty;   // L1 list of pages with dirty cards
+        MemoryAllocator* owner;  // allocator which created this page
+        size_t      slotSize;    // size of slot (including object header), 0 for blocks of mark-region layout
+        size_t      nSlots;      // number of slots in this page
+        size_t      pageSize;    // size of the page (PAGE_SIZE for pages of size classes)
+        ObjectHeader* freeList;  // free slots collected by sweeping this page but not yet moved to size class
+        ObjectHeader* freeTail;  // last slot in page free list
+        size_t      young;       // page is included in list of pages with young objects
+        size_t      dirty;       // page is included in list of pages with dirty cards
+        size_t      mapped;      // page is mapped from OS (and not allocated from C heap)
+        size_t      freeTime;    // time (msec) when empty page was placed in the cache
+        size_t      region;      // page is block of mark-region layout
+        size_t volatile nPending;// number of unreachable objects of the block waiting for finalization (block is not reused until they are finalized)
+        size_t volatile nFinalizable; // number of objects of the page requested finalization (0 - sweep reclaims dead slots without inspecting them)
+        size_t      pointerFree; // objects of the page contain no references: they are marked without being traversed
+        size_t      padding[1];  // align bitmap and slots on 16 bytes
+        unsigned char cards[N_CARDS]; // card table (non-zero for dirty cards)
+        unsigned char lines[N_LINES]; // map of used lines built by sweep of block (non-zero for used lines)
+        size_t      oldBits[BITMAP_WORDS];  // mark bits of old objects saved by minor GC (or pinned objects during compacting GC)
+        size_t      markBits[BITMAP_WORDS]; // mark bitmap
+
+        ObjectHeader* getSlot(size_t i) { 
+            return (ObjectHeader*)((char*)(this + 1) + i*slotSize);
+        }
+
+        static MemoryPage* getPage(Object const* obj) { 
+            return (MemoryPage*)((size_t)obj & ~((size_t)PAGE_SIZE-1));
+        }
+
+        static size_t getBitIndex(Object const* obj) { 
+            return ((size_t)obj & (PAGE_SIZE-1)) / GRANULE;
+        }
+
+        static bool isMarked(Object const* obj) { 
+            size_t bit = getBitIndex(obj);
+            return (getPage(obj)->markBits[bit / (sizeof(size_t)*8)] >> (bit % (sizeof(size_t)*8))) & 1;
+        }
+    };
+
+    /**
+     * Map of address space divided into PAGE_SIZE chunks to pages of all allocators.
+     * It is used by write barrier to check whether reference is located in garbage collected heap and locate its card.
+     */
+    class PageMap
+    {
+        enum { 
+            CHUNK_BITS = 16, // log2(MemoryPage::PAGE_SIZE)
+            LEAF_BITS = 16,
+            ROOT_BITS = 16   // 48 bit address space is covered
+        };
+        static MemoryPage** volatile root[1 << ROOT_BITS];
+
+      public:
+        static MemoryPage* find(void const* addr) { 
+            size_t chunk = (size_t)addr >> CHUNK_BITS;
+            if ((chunk >> LEAF_BITS) >= ((size_t)1 << ROOT_BITS)) { 
+                return NULL;
+            }
+            MemoryPage** leaf = root[chunk >> LEAF_BITS];
+            return leaf != NULL ? leaf[chunk & ((1 << LEAF_BITS) - 1)] : NULL;
+        }
+
+        /**
+         * Associate all chunks of the page with the specified value (page itself or NULL)
+         */
+        static void set(MemoryPage* page, MemoryPage* value);
+    };
+
+    /**
+     * Size class: free slots of the same size and pages containing them
+     */
+    struct SizeClass
+    { 
+        ObjectHeader* freeList; // L1 list of free slots
+        MemoryPage*   pages;    // L1 list of swept pages of this size class
+        MemoryPage*   unswept;  // L1 list of pages not yet swept after last GC
+        MemoryPage*   swept;    // L1 list of swept pages which free slots are not yet moved to free list
+    };
+
+    /**
+     * Layout of heap used for small objects
+     */
+    enum HeapLayout 
+    { 
+        SEGREGATED_FITS, // pages of slots of the same size class with free lists
+        MARK_REGION      // blocks of lines with bump pointer allocation (objects larger than line are still allocated from size classes)
+    };
+
+    /**
+     * Stack of grey objects: objects which are already marked but which references are not yet traversed.
+     * Stack is extended on demand until its size reaches the specified limit. 
+     */
+    class MarkStack 
+    {
+      public:
+        /**
+         * Push object to the stack
+         * @return false if stack can not be extended
+         */
+        bool push(Object* obj) { 
+            if (used == allocated && !extend()) { 
+                return false;
+            }
+            items[used++] = obj;
+            return true;
+        }
+
+        /**
+         * Pop object from the stack
+         * @return top object or NULL if stack is empty
+         */
+        Object* pop() { 
+            return used != 0 ? items[--used] : NULL;
+        }
+
+        /**
+         * Get item at the specified depth (0 - top of the stack) without removing it
+         */
+        Object* peek(size_t depth) const { 
+            return items[used - depth - 1];
+        }
+
+        /**
+         * Get reference to item at the specified position (0 - bottom of the stack)
+         */
+        Object*& at(size_t pos) { 
+            return items[pos];
+        }
+
+        /**
+         * Remove items above the specified height
+         */
+        void truncate(size_t height) { 
+            used = height;
+        }
+
+        /**
+         * Number of items in the stack
+         */
+        size_t size() const { 
+            return used;
+        }
+
+        /**
+         * Reverse order of items pushed after the stack had the specified size
+         */
+        void reverse(size_t from) { 
+            for (size_t i = from, j = used; i + 1 < j; i++, j--) { 
+                Object* tmp = items[i];
+                items[i] = items[j-1];
+                items[j-1] = tmp;
+            }
+        }
+
+        size_t limit; // maximal number of items in the stack
+
+        MarkStack();
+        ~MarkStack();
+
+      private:
+        bool extend();
+
+        Object** items;
+        size_t   used;
+        size_t   allocated;
+    };
+
+    /**
+     * Packet of marking work used to distribute mark phase between several threads.
+     * Packet contains either grey objects taken from the mark stack of busy mark thread, 
+     * either part of large array of references which should be marked.
+     */
+    struct MarkPacket 
+    {
+        enum { SIZE = 256 };
+        MarkPacket* next;
+        Object**    refs;   // references to be marked or "objects" for packet of grey objects
+        size_t      nRefs;  // number of references
+        bool        grey;   // packet contains grey objects 
+        Object*     objects[SIZE];
+    };
+
+    struct MarkWorker;
+
+    /**
+     * Cross-heap remembered set: hash table of objects of the allocator referenced from heaps of other allocators.
+     * Objects of the set are roots for GC of their owner. Each entry is stamped with epoch (sequence number of major mark phase)
+     * of the allocator which heap contains the reference: entries not confirmed by the mark phase of that allocator are removed.
+     */
+    class RememberedSet
+    {
+      public:
+        struct Entry
+        {
+            Object* obj;             // referenced object (NULL for free position of the table)
+            MemoryAllocator* source; // allocator which heap contains the reference
+            size_t epoch;            // epoch of the source in which reference was found
+        };
+
+        /**
+         * Add entry or update epoch of existing entry
+         */
+        void add(Object* obj, MemoryAllocator* source, size_t epoch);
+
+        /**
+         * Remove entries of the source found before the specified epoch. 
+         * Entries stored by barriers since the previous purge are stamped with this epoch: the next mark phase of the source should confirm them.
+         */
+        void purge(MemoryAllocator* source, size_t epoch);
+
+        /**
+         * Replace source of entries found before the specified epoch ((size_t)-1 - all entries of the source)
+         * @param newSource new source of entries (NULL - entries are removed)
+         * @param newEpoch epoch of entries of the new source
+         */
+        void rebind(MemoryAllocator* source, size_t epoch, MemoryAllocator* newSource, size_t newEpoch);
+
+        /**
+         * Remove all entries
+         */
+        void clear();
+
+        /**
+         * Size of hash table (entries are enumerated by at())
+         */
+        size_t capacity() const { 
+            return allocated;
+        }
+
+        /**
+         * Get entry at the specified position of hash table
+         */
+        Entry const& at(size_t pos) const { 
+            return table[pos];
+        }
+
+        RememberedSet();
+        ~RememberedSet();
+
+      private:
+        Entry* table;
+        size_t used;
+        size_t allocated;
+    };
+
+    /**
+     * Heap shared by several threads (see MemoryAllocator::setSharedHeap). Each thread still allocates objects
+     * from pages of its own allocator (thread local allocation buffer), so allocation takes no locks,
+     * but garbage collection is performed for all allocators of the heap together: thread initiated GC 
+     * stops all other threads at safepoints, then each stopped thread
+     * clears mark bits of its pages and marks its own roots in parallel with others, 
+     * so objects are protected from GC while they are reachable from roots of any thread of the heap.
+     * After mark phase each thread sweeps its own pages and resumes execution.
+     * Safepoints are allowGC(), gc() and allocation requests of allocators with automatic start of GC enabled
+     * (in this case all objects used by thread are supposed to be protected by roots, 
+     * while otherwise objects referenced only by C++ local variables remain unprotected until allowGC()).
+     * Threads blocked for a long time (in I/O, waiting for events,...) should do it within SafeRegion, 
+     * otherwise GC will wait until they reach safepoint.
+     */
+    class SharedHeap
+    {
+        friend class MemoryAllocator;
+      public:
+        SharedHeap();
+        ~SharedHeap();
+
+      private:
+        enum Phase { 
+            IDLE,        // no GC is in progress or threads are being stopped
+            CLEAR_MARKS, // stopped threads complete sweep of the previous GC and clear mark bits of their pages
+            MARK         // stopped threads mark their roots
+        };
+        Mutex   mutex;              // protects state of the heap
+        Event   event;              // signaled when thread is stopped or phase of GC is changed
+        MemoryAllocator* members;   // L1 list of allocators of the heap
+        size_t  nMembers;           // number of allocators of the heap
+        size_t  nStopped;           // number of allocators stopped at safepoint or in safe region
+        size_t  nBusy;              // number of stopped threads which have not yet completed current phase
+        Phase   phase;              // current phase of GC
+        MemoryAllocator* collector; // allocator which has initiated GC (NULL if no GC is in progress)
+        AnyWeakRef* weakReferences; // L1 list of weak references found by all mark threads
+    };
+
     /**
      * Memory allocator class with implicit memory deallocation (garbage collector). 
      * Each thread should have its own allocator. So each thread is allocating and deallocating only its own objects.
-     * But it is possible to refer object created by some global allocator, taken in account that this objects will not be protected from GC.
+     * But it is possible to refer object created by other allocator: objects stored in references located in heap of this allocator
+     * and objects found by its GC are included in remembered set of their owner, which doesn't reclaim them 
+     * until GC of this allocator finds that they are not referenced any more (or allocators are attached to the same SharedHeap).
+     * Objects referenced only from other threads' Var<T> variables and cycles of references between heaps are not protected in this way.
      */
     class MemoryAllocator
     {
@@ -41,13 +383,29 @@ namespace GC
         /**
          * Get allocator for the current thread. Each thread should have its own allocator.
          */
-        static MemoryAllocator* getCurrent();
+        static MemoryAllocator* getCurrent() { 
+            MemoryAllocator* allocator = ctx.get();
+            assert(allocator != NULL);
+            return allocator;
+        }
 
         /**
          * Allocate object 
          * @param object size
          */
-        static void* allocate(size_t size);
+        static void* allocate(size_t size) { 
+            return getCurrent()->_allocate(size);
+        }
+
+        /**
+         * Allocate object which contains no references to other garbage collected objects (like Boehm's GC_malloc_atomic).
+         * Such objects are placed in separate pages and mark phase just sets their mark bits, without invoking their mark() method
+         * and accessing their content.
+         * @param object size
+         */
+        static void* allocatePointerFree(size_t size) { 
+            return getCurrent()->_allocate(size, true);
+        }
 
         /**
          * Mark object as reachable and recursively mark all references objects
@@ -55,6 +413,18 @@ namespace GC
          */
         static void mark(Object* obj);
 
+        /**
+         * Mark object referenced by the specified field. Unlike mark(Object*) it allows compaction to move referenced object
+         * and update the field, while objects marked by mark(Object*) are pinned by compacting GC.
+         * It is no-op if no allocator is traversing objects, so copying of references by mutator costs nothing.
+         * @param ref address of reference to marked object
+         */
+        static void markRef(Object* const* ref) { 
+            if (nTracingAllocators != 0 && *ref != NULL) { 
+                traceRef(ref);
+            }
+        }
+
         /**
          * Mark array of objects.
          * @param refs pointer to array of references
@@ -73,10 +443,13 @@ namespace GC
         /**
          * Register root object. Registering root protects it and all referenced objects from GC.
          */
-        static void registerRoot(Root* root);
+        static void registerRoot(Root* root) { 
+            getCurrent()->_registerRoot(root);
+        }
             
         /**
          * Unregister root object. Make this object tree available for GC.
+         * Root is unregistered in the allocator in which it was registered (it is not the current one inside parcel scope).
          */
         static void unregisterRoot(Root* root);
 
@@ -85,11 +458,128 @@ namespace GC
          */
         static void gc();
 
+        /**
+         * Perform garbage collection compacting the heap: live objects of each size class are slided to the beginning of its pages
+         * and all references to them are updated, so empty pages are released. Objects in large pages and in blocks of
+         * mark-region layout are not moved. References are updated only in fields traversed through Ref<T>, WeakRef<T>, ObjectArray<T>
+         * (GC_MARK or GC_TRACE) and in Var<T>, ArrayVar<T> and VectorVar<T> variables. Objects referenced by plain C++ pointers 
+         * (including objects marked by mark(Object*) and objects referenced from other threads) should be pinned with Pin. 
+         * Objects which have called Object::destructInOwnerThread() are never moved. Objects are moved by memcpy, 
+         * so they should not contain pointers to themselves.
+         */
+        static void compact();
+
+        /**
+         * Start building parcel: graph of objects which will be handed off to other thread without copying.
+         * Until endParcel() objects allocated by the current thread (and roots registered by it) are placed in a separate allocator 
+         * (with thresholds and heap layout of the current one), which pages are then adopted by allocator of the receiver.
+         * Objects of the parcel should reference only each other: references to objects of other allocators are not protected 
+         * while parcel is in transit. If allocator of the current thread is attached to SharedHeap, it stays in SafeRegion until endParcel().
+         * Variables registered before beginParcel() may be destroyed inside parcel scope. Parcels may be nested.
+         */
+        static void beginParcel();
+
+        /**
+         * Complete building of the parcel. Roots registered after beginParcel() should be already unregistered.
+         * Unreachable objects of the parcel waiting for finalization are finalized by this method.
+         * @param root root of the graph
+         * @return parcel which can be passed to other thread (for example through ParcelQueue) or NULL if beginParcel() was not called,
+         * roots registered after it are not unregistered or root is not object of the parcel (building of the parcel is not completed then)
+         */
+        static Parcel* endParcel(Object* root);
+
+        /**
+         * Take ownership of objects of the parcel: its pages are moved to allocator of the current thread (objects are not copied),
+         * so they are traced and swept by GC of this thread and GC of the thread which has built the parcel doesn't see them any more.
+         * Parcel is deallocated.
+         * @param parcel parcel returned by endParcel()
+         * @return root of the graph (it should be referenced from roots of this thread before next GC)
+         */
+        static Object* openParcel(Parcel* parcel);
+
         /**
          * Start garbage collection if number of allocated objects since last GC exceeds StartThreshold 
          */
         static void allowGC();
+
+        /**
+         * Complete sweeping of pages left unswept by the last GC in lazy sweep mode.
+         * It reclaims memory of all unreachable objects (except objects waiting for finalization) and releases empty pages.
+         */
+        static void finishSweep();
+
+        /**
+         * Invoke destructors of unreachable objects placed in finalization queue by sweep (see Object::requireFinalization)
+         * and of objects which should be destructed by the owner thread. Sweep never invokes destructors itself,
+         * so application calls this method when it can afford it (unless finalizer thread drains the queue, see setFinalizerThread).
+         * Slots of finalized objects are reused after next sweep of their pages (or immediately if there are no unswept pages).
+         * @param maxObjects maximal number of objects to finalize
+         * @return number of finalized objects
+         */
+        static size_t runFinalizers(size_t maxObjects = (size_t)-1);
+
+        /**
+         * Return all cached empty pages to OS regardless of decay time (see setMemoryDecay).
+         * Pages left unswept by the last GC in lazy sweep mode are not released: call finishSweep() before it to reclaim them.
+         */
+        static void releaseMemory();
+
+        /**
+         * Total size of objects (including headers) found alive by the last major GC
+         */
+        static size_t liveSize();
+
+        /**
+         * Barrier used by references to preserve tri-colour invariant during incremental marking:
+         * object which reference is overwritten by Ref<T> or taken from weak reference is marked (shaded grey).
+         * So all objects reachable at the beginning of mark phase remain reachable for GC (snapshot at the beginning).
+         * It is no-op if no allocator is performing incremental marking.
+         * @param obj shaded object (may be NULL)
+         */
+        static void shade(Object* obj) { 
+            if (nIncrementalMarkers != 0 && obj != NULL) { 
+                mark(obj);
+            }
+        }
+
+        /**
+         * Barrier used by references to track old-to-young references in generational mode:
+         * card containing updated reference is marked as dirty, if reference is located in garbage collected heap.
+         * It is no-op if no allocator is working in generational mode.
+         * @param field address of updated reference
+         */
+        static void rememberStore(void const* field) { 
+            if (nGenerationalAllocators != 0) { 
+                remember(field);
+            }
+        }
         
+        /**
+         * Barrier used by references to maintain cross-heap remembered sets: if object of one allocator is stored
+         * in reference located in heap of other allocator, it is added to the remembered set of its owner
+         * and so is not reclaimed by GC of the owner until GC of the other allocator finds that reference is not alive any more.
+         * It is no-op if there is only one allocator.
+         * @param field address of updated reference
+         * @param obj stored object (may be NULL)
+         */
+        static void rememberForeign(void const* field, Object const* obj) { 
+            if (nAllocators > 1 && obj != NULL) { 
+                rememberReference(field, obj);
+            }
+        }
+
+        /**
+         * Barrier used by constructors of references: it is the same as rememberForeign(), but location of the reference is checked inline,
+         * so construction of references outside heap (local variables, temporaries, copies made by GC_MARK) doesn't call rememberReference()
+         * @param field address of initialized reference
+         * @param obj stored object (may be NULL)
+         */
+        static void rememberInitialized(void const* field, Object const* obj) { 
+            if (nAllocators > 1 && obj != NULL && PageMap::find(field) != NULL) { 
+                rememberReference(field, obj);
+            }
+        }
+
         /**
          * Create instance of memory allocator 
          * @param gcStartThreshold total size of objects allocated since last GC after which allowGC() method initiates garbage collection
@@ -102,30 +592,361 @@ namespace GC
          * Deallocate all objects create by GC.
          */
         ~MemoryAllocator();
+
+        /**
+         * Set limit for size of stack used to traverse graph of objects during mark phase.
+         * If stack is overflown, then objects which references are not traversed are located by scanning the heap.
+         * @param maxItems maximal number of items in the mark stack
+         */
+        void setMarkStackLimit(size_t maxItems);
+
+        /**
+         * Enable or disable lazy sweep mode. In this mode GC is performing only mark phase and 
+         * pages are swept on demand by allocation requests (or by finishSweep() method).
+         * @param enabled whether to sweep lazily
+         */
+        void setLazySweep(bool enabled);
+
+        /**
+         * Set number of threads performing mark phase. 
+         * If it is greater than one, then allocator starts nThreads-1 helper threads which are marking objects together
+         * with thread initiated GC. Root set and large arrays of references are split into packets 
+         * and busy threads share part of their work with idle threads.
+         * Please notice that in this case mark() method of objects is invoked by different threads.
+         * @param nThreads number of threads participating in mark phase (1 - sequential marking)
+         */
+        void setMarkThreads(size_t nThreads);
+
+        /**
+         * Enable or disable background sweeping. In this mode allocator starts sweeper thread 
+         * which reclaims memory of unreachable objects concurrently with mutator, 
+         * so thread initiated GC resumes its work right after mark phase. 
+         * Allocation requests take free slots of already swept pages or sweep pages themselves.
+         * @param enabled whether to sweep in background thread
+         */
+        void setBackgroundSweep(bool enabled);
+
+        /**
+         * Enable or disable finalizer thread. This thread invokes destructors of objects placed in finalization queue 
+         * as soon as sweep finds them unreachable, concurrently with mutator. 
+         * Objects which have called Object::destructInOwnerThread() are still destructed by the thread owning the allocator
+         * in allowGC() or runFinalizers().
+         * @param enabled whether to finalize objects in separate thread
+         */
+        void setFinalizerThread(bool enabled);
+
+        /**
+         * Enable or disable incremental marking. In this mode GC started by allowGC() marks roots and 
+         * then traverses objects in bounded slices interleaved with mutator execution:
+         * next slice is performed by allowGC() or by allocation request after markSliceStep bytes are allocated.
+         * Marking is completed and sweep is started only by allowGC() or gc() (when all live objects are protected by roots).
+         * Pages left unswept by previous GC (in lazy sweep mode) are also swept in slices before marking is started.
+         * Objects allocated during incremental marking are considered to be live.
+         * Pause time is proportional to slice size and number of roots rather than to heap size
+         * if sweeping is also not done in the same pause (see setLazySweep and setBackgroundSweep).
+         * Mark stack overflow is handled by rescanning the heap at the end of mark phase, so mark stack limit 
+         * should be large enough. Incremental marking is performed by the thread owning the allocator (setMarkThreads is not used).
+         * @param markSliceSize maximal number of objects traversed by one slice (0 - stop-the-world marking)
+         * @param markSliceStep size of objects allocated since last slice after which next slice is performed
+         */
+        void setIncrementalMarking(size_t markSliceSize, size_t markSliceStep = 256*1024);
+
+        /**
+         * Enable or disable generational mode. Objects surviving promotionAge minor GCs (and all objects surviving major GC)
+         * are promoted to the old generation. allowGC() performs minor GC when size of objects allocated since last GC
+         * exceeds nurserySize: minor GC traverses only young objects reachable from roots and from dirty cards of old objects
+         * and sweeps only pages where objects were allocated, so its cost is proportional to the amount of young objects.
+         * Major (full) GC is performed when size of promoted and allocated objects since last major GC exceeds gcStartThreshold
+         * and by gc(). References to young objects stored in old objects are tracked by barriers in Ref<T>, WeakRef<T> and ObjectArray<T>,
+         * so references from old objects to young objects should not be stored in plain C++ pointers.
+         * Minor GC is stop-the-world and is not using helper mark threads.
+         * @param nurserySize size of objects allocated since last GC after which allowGC() performs minor GC (0 - disable generational mode)
+         * @param promotionAge number of minor GCs object should survive to be promoted to the old generation
+         */
+        void setGenerational(size_t nurserySize, size_t promotionAge = 2);
+
+        /**
+         * Select layout of heap for small objects. In MARK_REGION layout objects not larger than MemoryPage::LINE_SIZE 
+         * are allocated by bumping pointer through free lines of blocks (Immix-style), 
+         * so allocation doesn't take free lists and size is rounded only to 16 bytes.
+         * Sweep of block is performed per line using the mark bitmap, without visiting dead objects.
+         * Block is reused only when all its lines are free, if it contains unreachable objects waiting for finalization.
+         * Objects already allocated in the previous layout remain in place. 
+         * Generational mode allocates objects from size classes regardless of this setting.
+         * @param layout layout of heap for newly allocated small objects
+         */
+        void setHeapLayout(HeapLayout layout);
+
+        /**
+         * Set size of objects placed in the large object space: each such object gets its own region of virtual memory 
+         * mapped from OS, which is returned to OS (unmapped) as soon as sweep finds the object dead,
+         * instead of being allocated from C heap. Large objects are never moved and their mark bit is kept in the page header.
+         * @param threshold minimal size of object allocated in the large object space
+         */
+        void setLargeObjectThreshold(size_t threshold);
+
+        /**
+         * Set decay time of free memory. Pages which become empty are cached by allocator for reuse (up to 64Mb, the rest are released immediately).
+         * Pages which are not reused during decay time are returned to OS: expired pages are released at the end of GC
+         * or explicitly by releaseMemory(), so memory taken during peak load is given back after it.
+         * @param decayTime time in milliseconds (0 - return empty pages to OS immediately, (size_t)-1 - never return them)
+         */
+        void setMemoryDecay(size_t decayTime);
+
+        /**
+         * Enable or disable adaptive triggering of GC. In this mode size of live objects is measured by each major GC 
+         * and the threshold used by allowGC() is set to growthPercent percents of it (bounded by minThreshold and maxThreshold),
+         * so next GC is started when heap has grown by this percent. Threshold of automatic start of GC (if it was enabled in constructor)
+         * is scaled in the same proportion to the threshold of allowGC() as was specified in constructor.
+         * @param growthPercent percent of live size which can be allocated before next GC (0 - thresholds are not changed any more)
+         * @param minThreshold minimal threshold of GC start
+         * @param maxThreshold maximal threshold of GC start
+         */
+        void setAdaptiveThreshold(size_t growthPercent, size_t minThreshold = 1024*1024, size_t maxThreshold = (size_t)-1);
+
+        /**
+         * Enable or disable automatic compaction (see compact()). If after GC more than fragmentationPercent percents of memory 
+         * of size class pages is free (and it is more than one page per size class), then next GC started by gc() or allowGC() compacts the heap.
+         * GC started by allocation request (see gcAutoStartThreshold) never compacts: objects referenced by C++ pointers of the caller are not moved.
+         * @param fragmentationPercent percent of free memory in pages after which heap is compacted (0 - disable automatic compaction)
+         */
+        void setCompactionThreshold(size_t fragmentationPercent);
+
+        /**
+         * Attach allocator to the heap shared by several threads (or detach it from the current heap).
+         * GC of shared heap is stop-the-world: incremental marking, generational mode and compaction are not used by it,
+         * but helper mark threads (setMarkThreads), lazy and background sweeping are.
+         * Allocator should be attached by the thread owning it, and detached before other threads stop referencing its objects:
+         * objects of allocator are destroyed together with it.
+         * @param heap shared heap (NULL - detach allocator from the heap)
+         */
+        void setSharedHeap(SharedHeap* heap);
     
         // internal instance methods
         void  _registerRoot(Root* root);     
         void  _unregisterRoot(Root* root);        
+        size_t _getRootStackHeight();
+        void  _releaseRoots(size_t height);
         void  _mark(Object* obj);
         void  _mark(Object** refs, size_t nRefs);
-        void* _allocate(size_t size);
-        void  _gc();
+        void  _markRef(Object* const* ref) { 
+            if (compacting) { 
+                updateRef((Object**)ref);
+            } else { 
+                _mark(*ref);
+            }
+        }
+        void  _pin(Object* obj);
+        void  _compact();
+        void* _allocate(size_t size, bool pointerFree = false);
+        void  _gc(bool mayCompact = true);
         void  _allowGC();
+        void  _finishSweep();
+        size_t _runFinalizers(size_t maxObjects);
+        void  _releaseMemory();
+        size_t _liveSize() const { 
+            return liveObjectsSize;
+        }
         void _visit(AnyWeakRef* wref);
+        void _registerFinalizable(Object* obj);
+        void _enterSafeRegion();
+        void _leaveSafeRegion();
+        void _beginParcel();
+        Parcel* _endParcel(Object* root);
+        Object* _openParcel(Parcel* parcel);
 
       private:
         void markPhase();
+        void markRoots();
+        void collectSharedHeap();
+        void safepoint();
+        void endPhase();
+        static void resetWeakReferences(AnyWeakRef* list);
+        void adopt(MemoryAllocator* donor);
+        void adoptPage(MemoryPage* page);
+        void startIncrementalMarking();
+        bool markSlice(size_t budget);
+        bool sweepSlice(size_t budget);
+        void minorGC();
+        void scanDirtyCards();
+        void minorSweep();
+        bool promote(ObjectHeader* hdr);
+        void updateRememberedSet();
+        void resetGenerations();
+        void setTracing(bool enabled);
+        static void traceRef(Object* const* ref);
+        static void markCard(MemoryPage* page, void const* addr);
+        static void remember(void const* field);
+        static void rememberReference(void const* field, Object const* obj);
+        void rememberIncoming(Object* obj, MemoryAllocator* source, size_t epoch);
+        void markIncoming(MemoryAllocator* owner);
+        void purgeOutgoing();
+        void finishMarkPhase();
+        void clearMarks();
+        void traceReferences();
+        void parallelMark(MarkStack* stack);
+        bool getMarkWork(size_t& batch, MarkPacket*& packet);
+        void shareMarkWork(MarkStack* stack);
+        void shareMarkWork(Object** refs, size_t nRefs);
+        MarkPacket* allocateMarkPacket();
+        void stopMarkThreads();
+        static void markThread(void* arg);
+        void rescanMarkedObjects();
+        void rescanPages(MemoryAllocator* owner);
         void sweepPhase();
+        MemoryPage* takeUnsweptPage(SizeClass* sc);
+        void sweepPage(SizeClass* sc, MemoryPage* page);
+        void sweepLargePage(MemoryPage* page);
+        void sweepLargePages();
+        bool refillFreeList(SizeClass* sc);
+        SizeClass* getSizeClass(MemoryPage* page);
+        void enqueueFinalization(ObjectHeader* first, ObjectHeader* last, ObjectHeader* firstZombie, ObjectHeader* lastZombie);
+        size_t finalizeObjects(ObjectHeader* volatile* queue, size_t maxObjects, bool owner);
+        void processZombies();
+        void stopSweepThread();
+        static void sweepThread(void* arg);
+        void stopFinalizerThread();
+        static void finalizerThread(void* arg);
+        MemoryPage* allocatePage(size_t pageSize, bool mapped = false);
+        void freePage(MemoryPage* page);
+        void releasePage(MemoryPage* page);
+        void releaseFreePages(size_t releaseTime);
+        void decayFreePages();
+        void adjustThresholds();
+        ObjectHeader* allocateSmall(SizeClass* sc);
+        ObjectHeader* allocateLarge(size_t size, bool pointerFree);
+        ObjectHeader* allocateInRegion(size_t size);
+        bool findFreeLines();
+        MemoryPage* takeUnsweptBlock();
+        void sweepBlock(MemoryPage* page);
+        void sweepBlocks();
+        void traceBlockObjects(MemoryPage* page, size_t from, size_t till, bool remember);
+        void checkFinalizableObjects();
+        bool isPinned(MemoryPage* page, ObjectHeader* hdr) const;
+        bool isOccupied(MemoryPage* page, ObjectHeader* hdr) const;
+        Object* forward(Object* obj) const;
+        void updateRef(Object** ref);
+        void computeForwardingAddresses();
+        void updateReferences();
+        void moveObjects();
 
       private:
         size_t  allocated;
-        Root*   roots;
-        ObjectHeader* objects;
+        Root**  rootStack;          // shadow stack of registered roots (NULL for roots unregistered not in LIFO order)
+        size_t  nRoots;             // height of root stack
+        size_t  rootStackSize;      // allocated size of root stack
+        SizeClass classes[MemoryPage::N_SIZE_CLASSES*2]; // segregated free lists of small objects followed by free lists of pointer-free objects
+        MemoryPage* largePages;     // L1 list of pages with large objects
+        MemoryPage* unsweptLargePages; // L1 list of pages with large objects not yet swept after last GC
+
+        // Mark-region layout
+        HeapLayout layout;          // layout of heap for newly allocated small objects
+        MemoryPage* blocks;         // L1 list of swept blocks taken for allocation or having no free lines
+        MemoryPage* recyclableBlocks; // L1 list of swept blocks with free lines
+        MemoryPage* unsweptBlocks;  // L1 list of blocks not yet swept after last GC
+        MemoryPage* currentBlock;   // block in which objects are allocated
+        size_t  nextLine;           // line of current block from which search of free lines is continued
+        char*   regionCursor;       // next free byte in the current range of free lines
+        char*   regionLimit;        // end of the current range of free lines
+        MarkStack finalizableObjects; // objects of blocks which requested finalization (blocks are not walked by sweep)
+        size_t  largeObjectThreshold; // minimal size of object which page is mapped from OS
+        bool    lazySweep;          // sweep pages on demand instead of sweeping whole heap after mark phase
+        bool    sweepPending;       // there are unswept pages
+        MemoryPage* freePages;      // L1 list of cached empty pages (most recently released first)
+        size_t  nCachedPages;       // number of pages in the cache
+        size_t  memoryDecay;        // time (msec) after which cached empty page is returned to OS
         AnyWeakRef* weakReferences;
+        MarkStack markStack;        // stack of grey objects
+        bool    marking;            // mark phase is in progress
+        bool    markStackOverflow;  // some grey objects were not pushed to the mark stack
+        bool    tracing;            // mark() methods of objects are invoked by GC (and not by mutator)
+
+        // Incremental marking
+        size_t  markSliceSize;      // maximal number of objects traversed by one slice (0 - incremental marking is disabled)
+        size_t  markSliceStep;      // size of objects allocated between two mark slices
+        size_t  nextMarkSlice;      // value of "allocated" at which next slice is performed
+        bool    incrementalMarking; // incremental mark phase is in progress
+
+        // Generational mode
+        size_t  nurserySize;        // size of objects allocated since last GC which initiates minor GC (0 - generational mode is disabled)
+        size_t  promotionAge;       // number of minor GCs survived by object before its promotion to the old generation
+        size_t  nurseryStart;       // value of "allocated" after last GC
+        MemoryPage* youngPages;     // L1 list of pages containing young objects (young large pages are included only in this list)
+        MemoryPage* volatile dirtyPages; // L1 list of pages with dirty cards
+        MarkStack rememberedObjects;// old objects which references were traversed by minor GC
+        bool    probing;            // minor GC is checking whether object refers young objects
+        bool    youngRefFound;      // object checked by minor GC refers young object
+        bool    minorMarking;       // mark phase of minor GC is in progress
+
+        // Parallel marking
+        size_t  nMarkThreads;       // number of threads participating in mark phase
+        MarkWorker** markWorkers;   // helper threads
+        bool    parallelMarking;    // parallel mark phase is in progress
+        Mutex   markMutex;          // protects shared state of parallel marking
+        Event   markEvent;          // signaled when new work is available or state of mark phase is changed
+        MarkPacket* markPackets;    // L1 list of packets with work shared by mark threads
+        MarkPacket* freeMarkPackets;// L1 list of free packets
+        size_t  nextRoot;           // index of next root to be traversed during parallel mark
+        size_t  markCycle;          // sequence number of parallel mark phase
+        size_t  nActiveHelpers;     // number of helper threads not yet completed current mark phase
+        bool    markingDone;        // all threads have no more work
+        bool    shutdown;           // helper threads should terminate
+        volatile size_t nIdleMarkers; // number of mark threads waiting for work
+
+        // Background sweeping
+        Thread* sweeper;            // background sweep thread (NULL if pages are swept by mutator)
+        Mutex   sweepMutex;         // protects lists of unswept and swept pages, page cache, finalization queue and list of zombies
+        Event   sweepEvent;         // signaled when new sweep cycle is started or sweeping of pages is completed
+        size_t  sweepCycle;         // sequence number of sweep phase
+        size_t  nPagesInSweep;      // number of pages taken for sweeping but not yet swept
+        bool    stopSweeper;        // sweeper thread should terminate
+        ObjectHeader* volatile zombies; // L1 list of unreachable objects which should be destructed by owner thread
+
+        // Finalization
+        ObjectHeader* volatile finalizationQueue; // L1 list of unreachable objects which destructors are not yet invoked
+        Thread* finalizer;          // finalizer thread (NULL if queue is drained by runFinalizers())
+        Event   finalizeEvent;      // signaled when objects are added to finalization queue
+        bool    stopFinalizer;      // finalizer thread should terminate
+
         size_t  startThreshold;
         size_t  autoStartThreshold;
 
+        // Adaptive GC triggering
+        size_t  liveObjectsSize;    // size of objects marked by the last major GC
+        size_t  growthPercent;      // threshold of GC start in percents of live size (0 - adaptive triggering is disabled)
+        size_t  autoStartPercent;   // threshold of automatic GC start in percents of threshold of allowGC() (0 - automatic GC is disabled)
+        size_t  minThreshold;       // lower bound for adaptive threshold
+        size_t  maxThreshold;       // upper bound for adaptive threshold
+
+        // Compaction
+        bool    pinning;            // mark phase of compacting GC: objects marked not through reference fields are pinned (in oldBits of their page)
+        bool    compacting;         // references are updated to forwarding addresses instead of marking
+        bool    compactionPending;  // next GC should compact the heap
+        size_t  compactionThreshold;// percent of free memory in size class pages after which heap is compacted (0 - never)
+
+        // Shared heap
+        SharedHeap* heap;           // heap shared with other threads (NULL if allocator collects only its own objects)
+        MemoryAllocator* nextMember;// next allocator of the shared heap
+        bool volatile safepointRequested; // thread should stop at safepoint to let other thread collect shared heap
+        bool    inSafeRegion;       // thread doesn't access objects, so GC of shared heap doesn't wait for it
+
+        // Parcels
+        MemoryAllocator* parent;    // allocator of the thread which has started building parcel in this allocator (NULL if it is not parcel)
+
+        // Cross-heap references
+        RememberedSet incoming;     // objects of this allocator referenced from heaps of other allocators
+        Mutex   incomingMutex;      // protects remembered set which is updated by other threads
+        size_t  markEpoch;          // sequence number of major mark phase: references to foreign objects found by it are stamped with it
+        MemoryAllocator* nextAllocator; // next allocator in the list of all allocators
+
         static ThreadContext<MemoryAllocator> ctx;
+        static size_t volatile nIncrementalMarkers; // number of allocators performing incremental marking
+        static size_t volatile nTracingAllocators; // number of allocators invoking mark() methods of objects
+        static size_t volatile nGenerationalAllocators; // number of allocators in generational mode
+        static size_t volatile nAllocators; // number of existing allocators (cross-heap references are possible if there are more than one)
+        static MemoryAllocator* allocators; // L1 list of all allocators
+        static Mutex allocatorsMutex; // protects list of allocators
+        static ThreadContext<MarkStack> markStackCtx; // mark stack of the current thread during parallel mark
     };
 
     /**
@@ -150,15 +971,39 @@ namespace GC
             return MemoryAllocator::allocate(fixedSize + varyingSize);
         }
 
+        /**
+         * Redefined operator new for all derived classes
+         * @param allocator allocator to be used (avoids lookup of allocator of the current thread)
+         */
+        void* operator new(size_t size, MemoryAllocator* allocator) 
+        { 
+            return allocator->_allocate(size);
+        }
+
+        /**
+         * Redefined operator new for all derived classes with varying size
+         * @param allocator allocator to be used (avoids lookup of allocator of the current thread)
+         */
+        void* operator new(size_t fixedSize, size_t varyingSize, MemoryAllocator* allocator)
+        { 
+            return allocator->_allocate(fixedSize + varyingSize);
+        }
+
         /**
          * Objects should not be explicitly deleted.
          * Unreachable objects are deleted by garbage collector.
          */
         void operator delete(void* obj) {
-            free((ObjectHeader*)obj - 1); 
+            ((ObjectHeader*)obj - 1)->next = (ObjectHeader*)ObjectHeader::FREE_SLOT; // object construction failed
         } 
         void operator delete(void* obj, size_t) { 
-            free((ObjectHeader*)obj - 1);             
+            ((ObjectHeader*)obj - 1)->next = (ObjectHeader*)ObjectHeader::FREE_SLOT;
+        } 
+        void operator delete(void* obj, MemoryAllocator*) { 
+            ((ObjectHeader*)obj - 1)->next = (ObjectHeader*)ObjectHeader::FREE_SLOT;
+        } 
+        void operator delete(void* obj, size_t, MemoryAllocator*) { 
+            ((ObjectHeader*)obj - 1)->next = (ObjectHeader*)ObjectHeader::FREE_SLOT;
         } 
 
       protected:
@@ -170,13 +1015,72 @@ namespace GC
         virtual void mark(MemoryAllocator* allocator) {}
 
         /**
-         * Virtual destructor used by memory allocator to finilize object
+         * Virtual destructor used by memory allocator to finilize object.
+         * It is invoked only for objects which have requested finalization (see requireFinalization).
          */
         virtual~Object() {}
 
         ObjectHeader* getHeader() { 
             return (ObjectHeader*)this - 1;
         }
+
+        /**
+         * Request invocation of destructor of this object when it becomes unreachable.
+         * It should be called by constructor of classes which destructors release resources (close files, free buffers,...).
+         * Memory of other objects is reclaimed by sweep without invocation of their destructors.
+         * Unreachable objects requested finalization are placed in finalization queue, which is drained 
+         * by MemoryAllocator::runFinalizers() or by finalizer thread, so destructors are not executed within GC.
+         * Destructor should not access other garbage collected objects: they may be already reclaimed.
+         */
+        void requireFinalization() { 
+            size_t flags = (size_t)getHeader()->next;
+            getHeader()->next = (ObjectHeader*)(flags | ObjectHeader::FINALIZABLE);
+            if (!(flags & (ObjectHeader::FINALIZABLE|ObjectHeader::OWNER_THREAD))) { 
+                MemoryPage::getPage(this)->owner->_registerFinalizable(this);
+            }
+        }
+
+        /**
+         * Request destruction of this object by the thread owning its allocator (in allowGC() or runFinalizers()).
+         * It implies finalization of the object and should be called instead of requireFinalization() by constructor 
+         * of classes which destructors access allocator or thread-specific data (for example unregister roots).
+         */
+        void destructInOwnerThread() { 
+            size_t flags = (size_t)getHeader()->next;
+            getHeader()->next = (ObjectHeader*)(flags | ObjectHeader::OWNER_THREAD);
+            if (!(flags & (ObjectHeader::FINALIZABLE|ObjectHeader::OWNER_THREAD))) { 
+                MemoryPage::getPage(this)->owner->_registerFinalizable(this);
+            }
+        }
+    };
+
+    /**
+     * Base class for garbage collected objects which contain no references to other garbage collected objects
+     * (strings, arrays of scalars,...). Such objects are allocated in separate pages and are not traversed by GC.
+     * Derived classes should not redefine mark() method.
+     */
+    class PointerFreeObject : public Object
+    {
+      public:
+        void* operator new(size_t size) 
+        { 
+            return MemoryAllocator::allocatePointerFree(size);
+        }
+
+        void* operator new(size_t fixedSize, size_t varyingSize)
+        { 
+            return MemoryAllocator::allocatePointerFree(fixedSize + varyingSize);
+        }
+
+        void* operator new(size_t size, MemoryAllocator* allocator) 
+        { 
+            return allocator->_allocate(size, true);
+        }
+
+        void* operator new(size_t fixedSize, size_t varyingSize, MemoryAllocator* allocator)
+        { 
+            return allocator->_allocate(fixedSize + varyingSize, true);
+        }
     };
 
     /**
@@ -209,7 +1113,18 @@ namespace GC
             return obj;
         }
         T* operator = (T const* val) {
-            return obj = (T*)val;            
+            MemoryAllocator::shade(obj); // write barrier
+            MemoryAllocator::rememberStore(this);
+            obj = (T*)val;
+            MemoryAllocator::rememberForeign(this, obj); // after the store: GC of the heap containing the reference may be in progress
+            return obj;
+        }
+        T* operator = (Ref<T> const& other) {
+            MemoryAllocator::shade(obj);
+            MemoryAllocator::rememberStore(this);
+            obj = other.obj;
+            MemoryAllocator::rememberForeign(this, obj);
+            return obj;
         }
         bool operator == (T const* other) { 
             return obj == other;
@@ -224,14 +1139,20 @@ namespace GC
             return obj != other.obj;
         }
         
-        Ref(T const* ptr = NULL) : obj((T*)ptr) {}
+        Ref(T const* ptr = NULL) : obj((T*)ptr) {
+            MemoryAllocator::rememberInitialized(this, obj); // reference may be initialized by constructor of object of other heap
+        }
 
         /**
          * Copy constructor marks referenced objects using current allocator (if any)
          */         
         Ref(Ref<T> const& ref) : obj(ref.obj) {
-            MemoryAllocator::mark(obj);
+            MemoryAllocator::markRef((Object* const*)&ref.obj); // original field is updated if object is moved by compaction
+            MemoryAllocator::rememberInitialized(this, obj);
         }
+
+        template<class U>
+        friend void trace(MemoryAllocator* allocator, Ref<U> const& ref);
     };
 
     /**
@@ -243,13 +1164,31 @@ namespace GC
     {
         friend class MemoryAllocator;
       protected:
-        AnyWeakRef* next;
+        AnyWeakRef* next; // not NULL if weak reference is registered by GC
         Object*     obj;
-        
-        AnyWeakRef(AnyWeakRef const& other) : obj(other.obj) { 
-            MemoryAllocator::visit(this);
+
+        /**
+         * Copy constructor is invoked by GC_MARK: register original weak reference 
+         */
+        AnyWeakRef(AnyWeakRef const& other) : next(NULL), obj(other.obj) { 
+            MemoryAllocator::visit((AnyWeakRef*)&other);
+        }
+        AnyWeakRef(Object const* ref) : next(NULL), obj((Object*)ref) {}
+
+        AnyWeakRef& operator = (AnyWeakRef const& other) { 
+            // Unlike Ref<T>, new value is shaded instead of overwritten one: weak reference never keeps its old object alive,
+            // so there is nothing to preserve for snapshot-at-the-beginning marking, but the stored object should not be
+            // lost by incremental GC which clears weak references to unmarked objects at the end of marking
+            MemoryAllocator::shade(other.obj);
+            MemoryAllocator::rememberStore(this);
+            obj = other.obj;
+            return *this;
+        }
+
+        Object* get() const { 
+            MemoryAllocator::shade(obj); // read barrier: weakly referenced object may be stored in strong reference
+            return obj;
         }
-        AnyWeakRef(Object const* ref) : obj((Object*)ref) {}
     };
             
     /**
@@ -263,25 +1202,28 @@ namespace GC
     {
       public:
         T& operator*() { 
-            return *(T*)obj;
+            return *(T*)get();
         }
         T const& operator*() const { 
-            return *(T*)obj;
+            return *(T*)get();
         }
         T* operator->() { 
-            return (T*)obj; 
+            return (T*)get(); 
         }
         T const* operator->() const { 
-            return (T*)obj; 
+            return (T*)get(); 
         }
         operator T*() { 
-            return (T*)obj;
+            return (T*)get();
         }
         operator T const*() const { 
-            return (T*)obj;
+            return (T*)get();
         }
         T* operator = (T const* val) {
-            return obj = (Object*)val;            
+            MemoryAllocator::shade((T*)val); // see AnyWeakRef::operator=
+            MemoryAllocator::rememberStore(this);
+            obj = (Object*)val;
+            return (T*)val;
         }
         bool operator == (T const* other) { 
             return obj == other;
@@ -299,6 +1241,23 @@ namespace GC
         WeakRef(T const* ptr = NULL) : AnyWeakRef(ptr) {}
     };
 
+    /**
+     * Trace strong reference field (used by GC_TRACE)
+     */
+    template<class T>
+    inline void trace(MemoryAllocator* allocator, Ref<T> const& ref) 
+    { 
+        allocator->_markRef((Object* const*)&ref.obj);
+    }
+
+    /**
+     * Trace weak reference field (used by GC_TRACE)
+     */
+    inline void trace(MemoryAllocator* allocator, AnyWeakRef const& wref) 
+    { 
+        allocator->_visit((AnyWeakRef*)&wref);
+    }
+
     /**
      * Base class for variables referencing objects and protecting them from GC.
      */
@@ -307,7 +1266,8 @@ namespace GC
         friend class MemoryAllocator;
 
       protected:
-        Root* next; // roots are linked in L1 list
+        size_t index; // position of the root in the root stack of the allocator
+        MemoryAllocator* allocator; // allocator in which root is registered
         
         /**
          * Mark root object
@@ -322,9 +1282,25 @@ namespace GC
         { 
             MemoryAllocator::registerRoot(this);
         }
+
+        /**
+         * Copy of the root is registered as new root
+         */
+        Root(Root const&) 
+        { 
+            MemoryAllocator::registerRoot(this);
+        }
+
+        /**
+         * Position in the root stack is not copied by assignment
+         */
+        Root& operator = (Root const&) 
+        { 
+            return *this;
+        }
         
         /**
-         * Unregister objects tree root in the current memory allocator
+         * Unregister objects tree root in the memory allocator in which it was registered
          */
         ~Root() 
         { 
@@ -332,6 +1308,118 @@ namespace GC
         }        
     };
 
+    /**
+     * Scope releasing all roots registered by the current thread after its construction at once.
+     * Roots are kept in shadow stack: registration pushes root at the top of the stack and unregistration of 
+     * the top root just pops it, so LIFO lifetimes (local Var<T> variables) cost O(1). Roots unregistered in
+     * other order leave hole in the stack which is popped later.
+     * Roots which are still alive when the scope is destroyed are not protected from GC any more 
+     * (their destructors do nothing), so RootScope may be used to drop roots of abandoned data structures
+     * (for example, when exception is thrown or long-living C++ objects with Var<T> members are reset).
+     */
+    class RootScope
+    {
+        MemoryAllocator* allocator;
+        size_t height;
+
+      public:
+        RootScope() 
+        { 
+            allocator = MemoryAllocator::getCurrent();
+            height = allocator->_getRootStackHeight();
+        }
+
+        /**
+         * Release roots registered since construction of the scope
+         */
+        ~RootScope() 
+        { 
+            allocator->_releaseRoots(height);
+        }
+    };
+
+    /**
+     * Scope in which the current thread doesn't access garbage collected objects (is blocked in I/O, waits for event,...),
+     * so GC of shared heap started by other thread doesn't wait for this thread to reach safepoint: its roots are marked by the thread performing GC.
+     * Destructor waits for completion of GC if it is in progress. It is no-op if allocator of the current thread is not attached to SharedHeap.
+     */
+    class SafeRegion
+    {
+        MemoryAllocator* allocator;
+
+      public:
+        SafeRegion() 
+        { 
+            allocator = MemoryAllocator::getCurrent();
+            allocator->_enterSafeRegion();
+        }
+
+        ~SafeRegion() 
+        { 
+            allocator->_leaveSafeRegion();
+        }
+    };
+
+    /**
+     * Graph of objects built by one thread and handed off to another thread without copying (see MemoryAllocator::beginParcel).
+     */
+    class Parcel
+    {
+        friend class MemoryAllocator;
+        friend class ParcelQueue;
+
+        MemoryAllocator* builder; // allocator which pages contain objects of the parcel
+        Object* root;             // root of the graph
+        Parcel* next;             // next parcel in the queue
+    };
+
+    /**
+     * Lock-free queue of parcels. Any thread can put parcels in the queue, but only one thread can take them.
+     * Producers push parcels to LIFO list using compare-and-swap, consumer detaches the whole list at once 
+     * and reverses it, so parcels are taken in FIFO order and there is no ABA problem.
+     */
+    class ParcelQueue
+    {
+      public:
+        /**
+         * Put parcel in the queue (may be called by any thread)
+         */
+        void put(Parcel* parcel);
+
+        /**
+         * Take parcel from the queue (should be called by the single consumer thread). It never blocks.
+         * @return the oldest parcel or NULL if queue is empty
+         */
+        Parcel* get();
+
+        ParcelQueue();
+
+        /**
+         * Destroy objects of parcels left in the queue
+         */
+        ~ParcelQueue();
+
+      private:
+        Parcel* volatile incoming; // LIFO list of parcels put by producers
+        Parcel* outgoing;          // FIFO list of parcels detached by consumer
+    };
+
+    /**
+     * Class protecting object referenced by plain C++ pointer (like "this") from GC.
+     * Pinned object is not moved by compaction (see MemoryAllocator::compact).
+     */
+    class Pin : Root
+    {
+        Object* obj;
+
+      public:
+        virtual void mark(MemoryAllocator* allocator) { 
+            allocator->_pin(obj);
+        }
+
+        Pin(Object* ptr) : obj(ptr) {}
+    };
+
     /**
      * Class for variable, protecting object tree from GC. 
      * It should be used instead of normal C++ pointers.
@@ -364,8 +1452,10 @@ namespace GC
             return obj;
         }
         T* operator = (T const* val) {
-            obj = (T*)val;
-            return val;
+            return obj = (T*)val;
+        }
+        T* operator = (Var<T> const& other) {
+            return obj = other.obj;
         }
         bool operator == (T const* other) { 
             return obj == other;
@@ -381,7 +1471,7 @@ namespace GC
         }
         
         virtual void mark(MemoryAllocator* allocator) { 
-            allocator->_mark(obj);
+            allocator->_markRef((Object* const*)&obj);
         }
 
         Var(T* ptr = NULL) : obj(ptr) {}
@@ -2,16 +2,25 @@
 #define  __GCCLASSES_H__
 
 #include <string.h>
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1800)
+#include <type_traits>
+#endif
 
 #include "gc.h"
 
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1800)
+#define GC_TRIVIALLY_DESTRUCTIBLE(T) std::is_trivially_destructible<T>::value
+#else
+#define GC_TRIVIALLY_DESTRUCTIBLE(T) __has_trivial_destructor(T)
+#endif
+
 namespace GC 
 {
     /**
      * Fixed size array of scalars
      */
     template<class T>
-    class ScalarArray : public Object
+    class ScalarArray : public PointerFreeObject
     {
       protected:
         size_t length;
@@ -21,6 +30,10 @@ namespace GC
         static ScalarArray* create(size_t len) { 
             return new ((len-1)*sizeof(T)) ScalarArray(len);
         }
+
+        static ScalarArray* create(size_t len, MemoryAllocator* allocator) { 
+            return new ((len-1)*sizeof(T), allocator) ScalarArray(len);
+        }
         
         T& operator[](size_t index) { 
             assert(index < length);
@@ -64,10 +77,42 @@ namespace GC
         static ObjectArray* create(size_t len) { 
             return new ((len-1)*sizeof(T*)) ObjectArray(len);
         }
+
+        static ObjectArray* create(size_t len, MemoryAllocator* allocator) { 
+            return new ((len-1)*sizeof(T*), allocator) ObjectArray(len);
+        }
         
-        T*& operator[](size_t index) { 
+        /**
+         * Element of the array returned by operator[]: assignment to it is performed by set()
+         */
+        class Element
+        {
+            ObjectArray* array;
+            size_t index;
+
+          public:
+            T* operator = (T const* obj) { 
+                array->set(index, obj);
+                return (T*)obj;
+            }
+            T* operator = (Element const& other) { 
+                T* obj = other;
+                array->set(index, obj);
+                return obj;
+            }
+            T* operator->() const { 
+                return array->body[index];
+            }
+            operator T*() const { 
+                return array->body[index];
+            }
+
+            Element(ObjectArray* a, size_t i) : array(a), index(i) {}
+        };
+
+        Element operator[](size_t index) { 
             assert(index < length);
-            return body[index];
+            return Element(this, index);
         }
 
         T* operator[](size_t index) const{ 
@@ -75,6 +120,17 @@ namespace GC
             return body[index];
         }
 
+        /**
+         * Store object in the element of the array passing it through write barriers
+         */
+        void set(size_t index, T const* obj) { 
+            assert(index < length);
+            MemoryAllocator::shade(body[index]);
+            MemoryAllocator::rememberStore(&body[index]);
+            body[index] = (T*)obj;
+            MemoryAllocator::rememberForeign(&body[index], obj); // after the store: GC of the heap containing the array may be in progress
+        }
+
         size_t size() const { 
             return length;
         }
@@ -107,7 +163,9 @@ namespace GC
         GC::Ref< ScalarArray<T> > body;
         size_t length;
         
-        virtual void mark(MemoryAllocator*) { GC_MARK(ScalarVector); }
+        GC_TRACE_BEGIN(ScalarVector)
+            GC_TRACE(body)
+        GC_TRACE_END
 
       public:
         ScalarVector(size_t reserve = 8) { 
@@ -122,7 +180,7 @@ namespace GC
                 allocated = allocated*2 > newSize ? allocated*2 : newSize;
                 ScalarArray<T>* newBody = ScalarArray<T>::create(allocated);
                 for (i = 0; i < length; i++) { 
-                    newBody[i] = body[i];
+                    (*newBody)[i] = (*body)[i];
                 }
                 body = newBody;
             }
@@ -176,7 +234,9 @@ namespace GC
         GC::Ref< ObjectArray<T> > body;
         size_t length;
         
-        virtual void mark(MemoryAllocator*) { GC_MARK(ObjectVector); }
+        GC_TRACE_BEGIN(ObjectVector)
+            GC_TRACE(body)
+        GC_TRACE_END
 
       public:
         ObjectVector(size_t reserve = 8) { 
@@ -191,7 +251,7 @@ namespace GC
                 allocated = allocated*2 > newSize ? allocated*2 : newSize;
                 ObjectArray<T>* newBody = ObjectArray<T>::create(allocated);
                 for (i = 0; i < length; i++) { 
-                    newBody[i] = body[i];
+                    (*newBody)[i] = (*body)[i];
                 }
                 body = newBody;
             }
@@ -213,7 +273,7 @@ namespace GC
             return (*body)[length-1];
         }
             
-        T*& operator[](size_t index) { 
+        typename ObjectArray<T>::Element operator[](size_t index) { 
             assert(index < length);
             return (*body)[index];
         }
@@ -240,7 +300,7 @@ namespace GC
     /**
      * Fixed size string class
      */
-    class String : public Object
+    class String : public PointerFreeObject
     {
         size_t length;
         char body[1]; 
@@ -256,6 +316,18 @@ namespace GC
             return new (len) String(str, len);
         }
 
+        static String* create(size_t len, MemoryAllocator* allocator) { 
+            return new (len, allocator) String(len);
+        }
+
+        static String* create(char const* str, MemoryAllocator* allocator) { 
+            return create(str, strlen(str), allocator);
+        }
+
+        static String* create(char const* str, size_t len, MemoryAllocator* allocator) {
+            return new (len, allocator) String(str, len);
+        }
+
         int compare(char const* other) { 
             return strcmp(body, other);
         }
@@ -299,10 +371,18 @@ namespace GC
      /**
       * Garbage collectable wrapper class for T.
       * "Object" should be first base in inheritance list.
+      * Destructor of T is invoked when wrapper becomes unreachable (unless T is trivially destructible:
+      * then wrapper is reclaimed by sweep like any other object without finalization).
       */
     template<class T>
     class Wrapper : public Object, public T
     {
+      public:
+        Wrapper() { 
+            if (!GC_TRIVIALLY_DESTRUCTIBLE(T)) { 
+                requireFinalization();
+            }
+        }
     };
 
 };
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "gcclasses.h"
+
+class Leaf : public GC::Object
+{
+  public:
+    GC::Ref<Leaf> next;
+    long value;
+
+    Leaf(long v) : value(v) {}
+
+  protected:
+    GC_TRACE_BEGIN(Leaf)
+        GC_TRACE(next)
+    GC_TRACE_END
+};
+
+typedef GC::ObjectArray<Leaf> Array;
+
+/**
+ * Measure time of marking large array of references to objects scattered over the heap
+ */
+int main(int argc, char* argv[])
+{
+    size_t nElems = argc > 1 ? atol(argv[1]) : 16*1024*1024;
+    int nullPercent = argc > 2 ? atoi(argv[2]) : 10;
+    const int nIterations = 5;
+
+    GC::MemoryAllocator mem((size_t)-1, (size_t)-1);
+    mem.setMarkStackLimit(nElems); // all elements are pushed to the mark stack
+    GC::Var<Array> arr = Array::create(nElems);
+    for (size_t i = 0; i < nElems; i++) {
+        (*arr)[i] = new Leaf(i);
+    }
+    for (size_t i = nElems; i > 1; i--) { // shuffle references, so that neighbour elements refer distant objects
+        size_t j = ((size_t)rand() * RAND_MAX + rand()) % i;
+        Leaf* tmp = (*arr)[i-1];
+        (*arr)[i-1] = (*arr)[j];
+        (*arr)[j] = tmp;
+    }
+    for (size_t i = 0; i < nElems; i++) {
+        if (rand() % 100 < nullPercent) {
+            (*arr)[i] = NULL;
+        }
+    }
+    mem.gc(); // release unreferenced objects
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nIterations; i++) {
+        mem.gc();
+    }
+    printf("Array of %ld elements: GC time %.1f msec\n", (long)nElems,
+           std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()*1000/nIterations);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "gcclasses.h"
+
+const size_t Mb = 1024*1024;
+
+class Tree : public GC::Object
+{
+  public:
+    GC::Ref<Tree> left;
+    GC::Ref<Tree> right;
+    GC::Ref<GC::String> label;
+
+    static Tree* build(size_t height) {
+        if (height == 0) {
+            return NULL;
+        }
+        Tree* tree = new Tree();
+        tree->label = GC::String::create("node");
+        tree->left = build(height-1);
+        tree->right = build(height-1);
+        return tree;
+    }
+
+  protected:
+    virtual void mark(GC::MemoryAllocator*) { GC_MARK(Tree); }
+};
+
+typedef GC::ObjectArray<Tree> Cache;
+
+/**
+ * Process short-living requests (small trees) in presence of large long-living cache,
+ * which is occasionally updated with results of requests
+ */
+static void measure(GC::MemoryAllocator& mem, GC::Var<Cache>& cache, int nTrees, char const* mode)
+{
+    const int nRequests = 200000;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nRequests; i++) {
+        Tree* tree = Tree::build(6);
+        if (i % 64 == 0) {
+            (*cache)[rand() % nTrees]->left = tree;
+        }
+        mem.allowGC();
+    }
+    mem.gc();
+    printf("%s: %.1f msec\n", mode, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()*1000);
+}
+
+int main(int argc, char* argv[])
+{
+    int nTrees = argc > 1 ? atoi(argv[1]) : 64;
+    int height = argc > 2 ? atoi(argv[2]) : 14;
+    size_t nurserySize = argc > 3 ? atoi(argv[3])*Mb : 4*Mb;
+
+    GC::MemoryAllocator mem(64*Mb);
+    GC::Var<Cache> cache = Cache::create(nTrees);
+    for (int i = 0; i < nTrees; i++) {
+        (*cache)[i] = Tree::build(height);
+    }
+    printf("Cache contains %ld objects\n", (long)nTrees*((2L << height) - 2));
+    measure(mem, cache, nTrees, "Full GC");
+
+    mem.setGenerational(nurserySize);
+    char mode[64];
+    sprintf(mode, "Generational GC (nursery %ldMb)", (long)(nurserySize/Mb));
+    measure(mem, cache, nTrees, mode);
+    return EXIT_SUCCESS;
+}
@@ -201,5 +201,16 @@ int main() {
         }
     }
     printf("Elapsed time for mark&sweep: %ld\n", time(NULL) - start);
+
+    {
+        GC::MemoryAllocator mem(1*Mb, 1*Mb);
+        mem.setHeapLayout(GC::MARK_REGION);
+        GC::ArrayVar<GCObject,liveObjects> objectRefs;
+        start = time(NULL);
+        for (size_t i = 0; i < totalObjects; i++) { 
+            objectRefs[i % liveObjects] = new GCObject();
+        }
+    }
+    printf("Elapsed time for mark&region: %ld\n", time(NULL) - start);
     return 0;
 }
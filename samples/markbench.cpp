@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "gcclasses.h"
+
+const size_t Mb = 1024*1024;
+
+class Tree : public GC::Object
+{
+  public:
+    GC::Ref<Tree> left;    
+    GC::Ref<Tree> right;
+    GC::Ref<GC::String> label;
+
+    static Tree* build(size_t height) { 
+        if (height == 0) { 
+            return NULL;
+        }
+        Tree* tree = new Tree();
+        tree->label = GC::String::create("node");
+        tree->left = build(height-1);
+        tree->right = build(height-1);
+        return tree;
+    }
+
+  protected:
+    GC_TRACE_BEGIN(Tree)
+        GC_TRACE(left)
+        GC_TRACE(right)
+        GC_TRACE(label)
+    GC_TRACE_END
+};
+
+typedef GC::ObjectArray<Tree> Wood;
+
+/**
+ * Measure time of garbage collection of heap with all objects alive for different number of mark threads
+ */
+int main(int argc, char* argv[]) 
+{ 
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 8;
+    int nTrees = argc > 2 ? atoi(argv[2]) : 64;
+    int height = argc > 3 ? atoi(argv[3]) : 16;
+    const int nIterations = 10;
+
+    GC::MemoryAllocator mem((size_t)-1, (size_t)-1);
+    GC::Var<Wood> wood = Wood::create(nTrees);
+    for (int i = 0; i < nTrees; i++) { 
+        (*wood)[i] = Tree::build(height);
+    }
+    printf("Heap contains %ld objects\n", (long)nTrees*((2L << height) - 2));
+    double singleThreadTime = 0;
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) { 
+        mem.setMarkThreads(nThreads);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < nIterations; i++) { 
+            mem.gc();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()*1000/nIterations;
+        if (nThreads == 1) { 
+            singleThreadTime = elapsed;
+        }
+        printf("Mark threads %d: GC time %.1f msec, speedup %.2f\n", nThreads, elapsed, singleThreadTime/elapsed);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "gcclasses.h"
+
+const size_t Mb = 1024*1024;
+
+class Tree : public GC::Object
+{
+  public:
+    GC::Ref<Tree> left;
+    GC::Ref<Tree> right;
+    GC::Ref<GC::String> label;
+
+    static Tree* build(size_t height) {
+        if (height == 0) {
+            return NULL;
+        }
+        Tree* tree = new Tree();
+        tree->label = GC::String::create("node");
+        tree->left = build(height-1);
+        tree->right = build(height-1);
+        return tree;
+    }
+
+    static size_t check(Tree* tree) {
+        if (tree == NULL) {
+            return 0;
+        }
+        if (!tree->label->equals("node")) {
+            fprintf(stderr, "Object of parcel was reclaimed\n");
+            abort();
+        }
+        return 1 + check(tree->left) + check(tree->right);
+    }
+
+  protected:
+    GC_TRACE_BEGIN(Tree)
+        GC_TRACE(left)
+        GC_TRACE(right)
+        GC_TRACE(label)
+    GC_TRACE_END
+};
+
+typedef GC::ObjectArray<Tree> Cache;
+
+const int nRequests = 100000;
+const int height = 6;
+const int cacheSize = 1024;
+const int maxPending = 64;
+
+GC::ParcelQueue queue;
+GC::Mutex mutex;
+GC::Event progress;
+int nSent;
+int nReceived;
+
+/**
+ * Parser builds request trees in parcels and hands them off to worker,
+ * while its own GC collects garbage allocated between requests
+ */
+static void parser(void*)
+{
+    GC::MemoryAllocator mem(Mb);
+    for (int i = 0; i < nRequests; i++) {
+        {
+            GC::CriticalSection cs(mutex);
+            while (i - nReceived > maxPending) {
+                progress.wait(mutex);
+            }
+        }
+        GC::MemoryAllocator::beginParcel();
+        Tree* tree = Tree::build(height);
+        queue.put(GC::MemoryAllocator::endParcel(tree));
+        {
+            GC::CriticalSection cs(mutex);
+            nSent = i + 1;
+            progress.signal();
+        }
+        (void)Tree::build(2); // garbage of parser
+        mem.allowGC();
+    }
+}
+
+/**
+ * Measure throughput of hand-off of object trees from parser thread to worker thread
+ */
+int main()
+{
+    GC::MemoryAllocator mem(16*Mb);
+    mem.setMemoryDecay(100); // pages of adopted parcels are not reused by parser, so return them to OS soon
+    GC::Var<Cache> cache = Cache::create(cacheSize);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    GC::Thread producer;
+    if (!producer.start(parser, NULL)) {
+        fprintf(stderr, "Failed to start thread\n");
+        return EXIT_FAILURE;
+    }
+    size_t nObjects = 0;
+    for (int i = 0; i < nRequests; i++) {
+        {
+            GC::CriticalSection cs(mutex);
+            while (nSent == i) {
+                progress.wait(mutex);
+            }
+        }
+        Tree* tree = (Tree*)GC::MemoryAllocator::openParcel(queue.get());
+        (*cache)[i % cacheSize] = tree;
+        {
+            GC::CriticalSection cs(mutex);
+            nReceived = i + 1;
+            progress.signal();
+        }
+        nObjects += Tree::check(tree);
+        Tree::check((*cache)[rand() % cacheSize]);
+        mem.allowGC();
+    }
+    producer.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()*1000;
+    printf("Handed off %d trees (%ld objects): %.1f msec, %.1f usec per tree\n",
+           nRequests, (long)nObjects, elapsed, elapsed*1000/nRequests);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "gcclasses.h"
+
+const size_t Mb = 1024*1024;
+
+class Tree : public GC::Object
+{
+  public:
+    GC::Ref<Tree> left;
+    GC::Ref<Tree> right;
+    GC::Ref<GC::String> label;
+
+    static Tree* build(size_t height) {
+        if (height == 0) {
+            return NULL;
+        }
+        Tree* tree = new Tree();
+        tree->label = GC::String::create("node");
+        tree->left = build(height-1);
+        tree->right = build(height-1);
+        return tree;
+    }
+
+  protected:
+    virtual void mark(GC::MemoryAllocator*) { GC_MARK(Tree); }
+};
+
+typedef GC::ObjectArray<Tree> Wood;
+
+/**
+ * Allocate garbage and replace parts of large live heap, measuring maximal pause of allowGC()
+ * with stop-the-world and incremental marking
+ */
+static void measure(GC::MemoryAllocator& mem, GC::Var<Wood>& wood, int nTrees, char const* mode)
+{
+    const int nIterations = 20000;
+    double maxPause = 0, totalPause = 0;
+    for (int i = 0; i < nIterations; i++) {
+        Tree* tree = Tree::build(8);
+        if (i % 16 == 0) {
+            (*wood)[rand() % nTrees]->left = tree;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        mem.allowGC();
+        double pause = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()*1000;
+        totalPause += pause;
+        if (pause > maxPause) {
+            maxPause = pause;
+        }
+    }
+    mem.gc();
+    printf("%s: max pause %.3f msec, total %.1f msec\n", mode, maxPause, totalPause);
+}
+
+int main(int argc, char* argv[])
+{
+    int nTrees = argc > 1 ? atoi(argv[1]) : 64;
+    int height = argc > 2 ? atoi(argv[2]) : 16;
+    size_t sliceSize = argc > 3 ? atoi(argv[3]) : 10000;
+
+    GC::MemoryAllocator mem(64*Mb);
+    mem.setLazySweep(true);
+    GC::Var<Wood> wood = Wood::create(nTrees);
+    for (int i = 0; i < nTrees; i++) {
+        (*wood)[i] = Tree::build(height);
+    }
+    printf("Heap contains %ld objects\n", (long)nTrees*((2L << height) - 2));
+    measure(mem, wood, nTrees, "Stop-the-world marking");
+
+    mem.setIncrementalMarking(sliceSize);
+    char mode[64];
+    sprintf(mode, "Incremental marking (slice %ld objects)", (long)sliceSize);
+    measure(mem, wood, nTrees, mode);
+    return EXIT_SUCCESS;
+}
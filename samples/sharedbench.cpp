@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "gcclasses.h"
+
+const size_t Mb = 1024*1024;
+
+class Tree : public GC::Object
+{
+  public:
+    GC::Ref<Tree> left;
+    GC::Ref<Tree> right;
+    GC::Ref<GC::String> label;
+
+    static Tree* build(size_t height) {
+        if (height == 0) {
+            return NULL;
+        }
+        Tree* tree = new Tree();
+        tree->label = GC::String::create("node");
+        tree->left = build(height-1);
+        tree->right = build(height-1);
+        return tree;
+    }
+
+    static size_t check(Tree* tree) {
+        if (tree == NULL) {
+            return 0;
+        }
+        if (!tree->label->equals("node")) {
+            fprintf(stderr, "Object of other thread was reclaimed\n");
+            abort();
+        }
+        return 1 + check(tree->left) + check(tree->right);
+    }
+
+  protected:
+    GC_TRACE_BEGIN(Tree)
+        GC_TRACE(left)
+        GC_TRACE(right)
+        GC_TRACE(label)
+    GC_TRACE_END
+};
+
+typedef GC::ObjectArray<Tree> Cache;
+
+const int nRequests = 20000;
+const int slotsPerThread = 16;
+
+GC::SharedHeap heap;
+Cache* cache; // referenced by root of the main thread
+GC::Mutex mutex;
+GC::Event finished;
+int nFinished;
+
+struct Worker
+{
+    GC::Thread thread;
+    int id;
+    int nThreads;
+};
+
+/**
+ * Worker builds short-living trees and publishes some of them in cache shared with other threads,
+ * and checks that trees published by other threads are not reclaimed by GC
+ */
+static void worker(void* arg)
+{
+    Worker* w = (Worker*)arg;
+    GC::MemoryAllocator mem(4*Mb);
+    mem.setSharedHeap(&heap);
+    for (int i = 0; i < nRequests; i++) {
+        Tree* tree = Tree::build(6);
+        if (i % 64 == 0) {
+            (*cache)[w->id*slotsPerThread + i/64 % slotsPerThread] = tree;
+        }
+        Tree::check((*cache)[rand() % (w->nThreads*slotsPerThread)]);
+        mem.allowGC();
+    }
+    {
+        GC::SafeRegion region; // do not delay GC of other threads while waiting for them
+        GC::CriticalSection cs(mutex);
+        if (++nFinished == w->nThreads) {
+            finished.signal();
+        }
+        while (nFinished != w->nThreads) {
+            finished.wait(mutex);
+        }
+    }
+    mem.setSharedHeap(NULL);
+}
+
+/**
+ * Measure throughput of threads allocating objects in shared heap for different number of threads
+ */
+int main(int argc, char* argv[])
+{
+    int maxThreads = argc > 1 ? atoi(argv[1]) : 32;
+
+    GC::MemoryAllocator mem;
+    mem.setSharedHeap(&heap);
+    GC::Var<Cache> root = Cache::create(maxThreads*slotsPerThread);
+    cache = root;
+    double singleThreadTime = 0;
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+        Worker* workers = new Worker[nThreads];
+        nFinished = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        {
+            GC::SafeRegion region; // roots of the main thread are marked by worker performing GC
+            for (int i = 0; i < nThreads; i++) {
+                workers[i].id = i;
+                workers[i].nThreads = nThreads;
+                if (!workers[i].thread.start(worker, &workers[i])) {
+                    fprintf(stderr, "Failed to start thread\n");
+                    return EXIT_FAILURE;
+                }
+            }
+            for (int i = 0; i < nThreads; i++) {
+                workers[i].thread.join();
+            }
+        }
+        delete[] workers;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()*1000;
+        if (nThreads == 1) {
+            singleThreadTime = elapsed;
+        }
+        printf("Threads %d: %.1f msec, throughput %.2f\n", nThreads, elapsed, singleThreadTime*nThreads/elapsed);
+        for (int i = 0; i < nThreads*slotsPerThread; i++) { // objects of terminated threads are destroyed
+            (*cache)[i] = NULL;
+        }
+    }
+    mem.setSharedHeap(NULL);
+    return EXIT_SUCCESS;
+}
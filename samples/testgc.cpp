@@ -22,7 +22,11 @@ class Tree : public GC::Object
     }
 
   protected:
-    virtual void mark(GC::MemoryAllocator*) { GC_MARK(Tree); }
+    GC_TRACE_BEGIN(Tree)
+        GC_TRACE(label)
+        GC_TRACE(left)
+        GC_TRACE(right)
+    GC_TRACE_END
 
     bool check(size_t& nNodes, size_t level, size_t height) {
         char buf[16];
@@ -49,7 +53,477 @@ class Tree : public GC::Object
 };
 
 typedef GC::ObjectArray<Tree> Wood;
+
+class Resource : public GC::Object
+{
+  public:
+    static size_t volatile nDestructed;
+
+    Resource() { 
+        requireFinalization();
+    }
+    ~Resource() { 
+        nDestructed += 1;
+    }
+};
+
+size_t volatile Resource::nDestructed;
+
+typedef GC::ObjectArray<Resource> Resources;
+
+class Item : public GC::Object
+{
+  public:
+    static size_t nDestructed;
+    size_t value;
+
+    Item(size_t val, bool finalizable) : value(val) { 
+        if (finalizable) { 
+            requireFinalization();
+        }
+    }
+    ~Item() { 
+        nDestructed += 1;
+    }
+};
+
+size_t Item::nDestructed;
+
+typedef GC::ObjectArray<Item> Items;
+
+static bool checkFinalization(GC::MemoryAllocator& mem)
+{
+    const size_t nObjects = 1000;
+    GC::Var<Resources> alive = Resources::create(nObjects);
+    Resource::nDestructed = 0;
+    for (size_t i = 0; i < nObjects*2; i++) { 
+        Resource* res = new Resource();
+        if (i & 1) { 
+            (*alive)[i/2] = res;
+        }
+    }
+    mem.gc();
+    GC::MemoryAllocator::finishSweep();
+    if (Resource::nDestructed != 0) { 
+        fprintf(stderr, "Destructor is invoked by sweep\n");
+        return false;
+    }
+    size_t nFinalized = GC::MemoryAllocator::runFinalizers();
+    if (nFinalized != nObjects || Resource::nDestructed != nObjects) { 
+        fprintf(stderr, "runFinalizers destructed %d objects instead of %d\n", (int)Resource::nDestructed, (int)nObjects);
+        return false;
+    }
+    mem.gc(); // slots of finalized objects are reclaimed, live objects are not finalized again
+    GC::MemoryAllocator::finishSweep();
+    if (GC::MemoryAllocator::runFinalizers() != 0) { 
+        fprintf(stderr, "Reachable object is finalized\n");
+        return false;
+    }
+    mem.setFinalizerThread(true);
+    alive = NULL;
+    mem.gc();
+    GC::MemoryAllocator::finishSweep();
+    time_t timeout = time(NULL) + 10;
+    while (Resource::nDestructed != nObjects*2 && time(NULL) < timeout);
+    mem.setFinalizerThread(false);
+    if (Resource::nDestructed != nObjects*2) { 
+        fprintf(stderr, "Finalizer thread destructed %d objects instead of %d\n", (int)(Resource::nDestructed - nObjects), (int)nObjects);
+        return false;
+    }
+    return true;
+}
+
+static bool checkBulkSweep(GC::MemoryAllocator& mem)
+{
+    const size_t nObjects = 10000;
+    const size_t nFinalizable = nObjects/50;
+    GC::Var<Items> alive = Items::create(nObjects);
+    Item::nDestructed = 0;
+    for (size_t i = 0; i < nObjects*2; i++) { 
+        Item* item = new Item(i, i % 100 == 0); // finalizable objects share pages with other ones and are all unreachable
+        if (i & 1) { 
+            (*alive)[i/2] = item;
+        }
+    }
+    mem.gc();
+    GC::MemoryAllocator::finishSweep();
+    if (GC::MemoryAllocator::runFinalizers() != nFinalizable) { 
+        fprintf(stderr, "Finalizable objects are lost by sweep\n");
+        return false;
+    }
+    mem.gc(); // pages are swept using only mark bitmap now
+    GC::MemoryAllocator::finishSweep();
+    if (Item::nDestructed != nFinalizable) { 
+        fprintf(stderr, "Destructor of object which has not requested finalization is invoked\n");
+        return false;
+    }
+    for (size_t i = 0; i < nObjects; i++) { 
+        Item* item = (*alive)[i];
+        if (item->value != i*2+1) { 
+            fprintf(stderr, "Live object %d is reclaimed by sweep\n", (int)i);
+            return false;
+        }
+        if (GC::MemoryPage::getPage(item)->nFinalizable != 0) { 
+            fprintf(stderr, "Finalized objects are still counted by their page\n");
+            return false;
+        }
+    }
+    return true;
+}
     
+static bool checkMarkRegion(GC::MemoryAllocator& mem)
+{
+    const size_t nObjects = 100000;
+    const size_t liveStep = 32; // live objects are separated by runs of free lines
+    const size_t nLive = nObjects/liveStep;
+    const size_t maxBlocks = 1024;
+    GC::MemoryPage* liveBlocks[maxBlocks];
+    size_t nBlocks = 0;
+
+    mem.setHeapLayout(GC::MARK_REGION);
+    GC::Var<Tree> tree = Tree::build(10);
+    GC::Var<Items> alive = Items::create(nLive);
+    for (size_t i = 0; i < nObjects; i++) { 
+        Item* item = new Item(i, false);
+        if (i % liveStep == 0) { 
+            (*alive)[i/liveStep] = item;
+            GC::MemoryPage* block = GC::MemoryPage::getPage(item);
+            if (nBlocks == 0 || liveBlocks[nBlocks-1] != block) { 
+                assert(nBlocks < maxBlocks);
+                liveBlocks[nBlocks++] = block;
+            }
+        }
+    }
+    mem.gc();
+    GC::MemoryAllocator::finishSweep();
+    GC::Var<Items> recycled = Items::create(nLive);
+    for (size_t i = 0; i < nLive; i++) { 
+        Item* item = new Item(nObjects + i, false);
+        (*recycled)[i] = item;
+        GC::MemoryPage* block = GC::MemoryPage::getPage(item);
+        size_t j = 0;
+        while (j < nBlocks && liveBlocks[j] != block) { 
+            j += 1;
+        }
+        if (j == nBlocks || block->lines[((size_t)item & (GC::MemoryPage::PAGE_SIZE-1)) / GC::MemoryPage::LINE_SIZE]) { 
+            fprintf(stderr, "Free lines of blocks are not recycled\n");
+            return false;
+        }
+    }
+    for (int pass = 0; pass < 2; pass++) { 
+        for (size_t i = 0; i < nLive; i++) { 
+            if ((*alive)[i]->value != i*liveStep || (pass == 0 && (*recycled)[i]->value != nObjects + i)) { 
+                fprintf(stderr, "Live object in block is overwritten\n");
+                return false;
+            }
+        }
+        if (!Tree::check(tree, 10)) { 
+            fprintf(stderr, "Check failed for tree in blocks\n");
+            return false;
+        }
+        recycled = NULL;
+        mem.gc();
+        GC::MemoryAllocator::finishSweep();
+    }
+    mem.setHeapLayout(GC::SEGREGATED_FITS);
+    return true;
+}
+
+static bool checkCompaction(GC::MemoryAllocator& mem)
+{
+    const size_t nTrees = 100;
+    const size_t height = 8;
+    GC::Var<Wood> wood = Wood::create(nTrees);
+    Tree* location[nTrees];
+    for (size_t i = 0; i < nTrees*4; i++) { 
+        Tree* tree = Tree::build(height); // three of four trees become garbage and leave holes in pages
+        if (i % 4 == 0) { 
+            (*wood)[i/4] = tree;
+        }
+    }
+    mem.gc();
+    for (size_t i = 0; i < nTrees; i++) { 
+        location[i] = (*wood)[i];
+    }
+    GC::MemoryAllocator::compact();
+    size_t nMoved = 0;
+    for (size_t i = 0; i < nTrees; i++) { 
+        nMoved += (*wood)[i] != location[i];
+        if (!Tree::check((*wood)[i], height)) { 
+            fprintf(stderr, "Check failed for compacted tree %d\n", (int)i);
+            return false;
+        }
+    }
+    if (nMoved == 0) { 
+        fprintf(stderr, "Compaction has not moved any object\n");
+        return false;
+    }
+    Tree* first = (*wood)[0];
+    mem.setCompactionThreshold(10);
+    GC::Var<Wood> fragments = Wood::create(nTrees*4);
+    for (size_t i = 0; i < nTrees*16; i++) { // GC is started by allocation requests
+        Tree* tree = Tree::build(height);
+        if (i % 4 == 0) { 
+            (*fragments)[i/4] = tree;
+        }
+    }
+    fragments = NULL;
+    for (size_t i = 0; i < nTrees*16; i++) { 
+        Tree::build(height);
+    }
+    mem.setCompactionThreshold(0);
+    if ((*wood)[0] != first) { 
+        fprintf(stderr, "Object is moved by GC started by allocation\n");
+        return false;
+    }
+    return true;
+}
+
+const size_t parcelHeight = 10;
+
+struct ParcelTest
+{
+    GC::ParcelQueue queue;
+    GC::Mutex mutex;
+    GC::Event event;
+    bool sent;
+    bool opened;
+    size_t builderLiveSize;
+};
+
+static void buildParcel(void* arg)
+{
+    ParcelTest* test = (ParcelTest*)arg;
+    GC::MemoryAllocator mem(1*Mb, 1*Mb);
+    GC::MemoryAllocator::beginParcel();
+    test->queue.put(GC::MemoryAllocator::endParcel(Tree::build(parcelHeight)));
+    (void)Tree::build(parcelHeight); // garbage of the builder
+    GC::CriticalSection cs(test->mutex);
+    test->sent = true;
+    test->event.signal();
+    while (!test->opened) { 
+        test->event.wait(test->mutex);
+    }
+    mem.gc();
+    test->builderLiveSize = GC::MemoryAllocator::liveSize();
+}
+
+static bool checkParcel(GC::MemoryAllocator& mem)
+{
+    ParcelTest test;
+    GC::Thread builder;
+    test.sent = test.opened = false;
+    if (!builder.start(buildParcel, &test)) { 
+        fprintf(stderr, "Failed to start thread\n");
+        return false;
+    }
+    GC::Var<Tree> tree;
+    {
+        GC::CriticalSection cs(test.mutex);
+        while (!test.sent) { 
+            test.event.wait(test.mutex);
+        }
+        tree = (Tree*)GC::MemoryAllocator::openParcel(test.queue.get());
+        test.opened = true;
+        test.event.signal();
+    }
+    builder.join(); // allocator of the builder is destroyed
+    mem.gc();
+    size_t liveSize = GC::MemoryAllocator::liveSize();
+    if (test.builderLiveSize >= liveSize) { 
+        fprintf(stderr, "Objects of opened parcel are traced by GC of its builder\n");
+        return false;
+    }
+    if (!Tree::check(tree, parcelHeight) || GC::MemoryPage::getPage(tree)->owner != &mem) { 
+        fprintf(stderr, "Objects of opened parcel are not owned by receiver\n");
+        return false;
+    }
+    tree = NULL;
+    mem.gc();
+    if (GC::MemoryAllocator::liveSize() >= liveSize) { 
+        fprintf(stderr, "Objects of opened parcel are not reclaimed by GC of receiver\n");
+        return false;
+    }
+    return true;
+}
+
+struct ParcelStart
+{
+    ~ParcelStart() { 
+        GC::MemoryAllocator::beginParcel();
+    }
+};
+
+static bool checkParcelOuterRoot(GC::MemoryAllocator& mem)
+{
+    size_t height = mem._getRootStackHeight();
+    { 
+        GC::Var<Tree> outer = Tree::build(parcelHeight);
+        ParcelStart start; // variable of the enclosing allocator is destroyed inside parcel scope
+    }
+    GC::Parcel* parcel = GC::MemoryAllocator::endParcel(Tree::build(parcelHeight));
+    GC::Var<Tree> tree = (Tree*)GC::MemoryAllocator::openParcel(parcel);
+    if (mem._getRootStackHeight() != height + 1) { 
+        fprintf(stderr, "Root destroyed inside parcel scope is not unregistered\n");
+        return false;
+    }
+    mem.gc();
+    if (!Tree::check(tree, parcelHeight)) { 
+        fprintf(stderr, "Check failed for parcel opened by its builder\n");
+        return false;
+    }
+    return true;
+}
+
+struct ForeignTest
+{
+    GC::Mutex mutex;
+    GC::Event event;
+    Tree* tree;
+    int step;
+    size_t ownerLiveSize;
+    size_t collectedLiveSize;
+};
+
+static void setStep(ForeignTest* test, int step)
+{
+    GC::CriticalSection cs(test->mutex);
+    test->step = step;
+    test->event.signal();
+}
+
+static void waitStep(ForeignTest* test, int step)
+{
+    GC::CriticalSection cs(test->mutex);
+    while (test->step < step) { 
+        test->event.wait(test->mutex);
+    }
+}
+
+static void collectForeignOwner(GC::MemoryAllocator& mem)
+{
+    for (int i = 0; i < 3; i++) { 
+        mem.gc();
+        (void)Tree::build(parcelHeight + 1); // reuses memory of reclaimed objects with different layout
+    }
+}
+
+static void ownForeignTree(void* arg)
+{
+    ForeignTest* test = (ForeignTest*)arg;
+    GC::MemoryAllocator mem(1*Mb, 1*Mb);
+    GC::Var<Tree> tree = Tree::build(parcelHeight);
+    test->tree = tree;
+    setStep(test, 1);
+    waitStep(test, 2); // tree is stored in heap of the main thread
+    tree = NULL;
+    collectForeignOwner(mem); // reference is not yet confirmed by GC of the main thread
+    setStep(test, 3);
+    waitStep(test, 4);
+    collectForeignOwner(mem); // reference is confirmed by GC of the main thread
+    test->ownerLiveSize = GC::MemoryAllocator::liveSize();
+    setStep(test, 5);
+    waitStep(test, 6); // reference is cleared and GC of the main thread has not found it
+    mem.gc();
+    test->collectedLiveSize = GC::MemoryAllocator::liveSize();
+}
+
+static bool checkForeignReference(GC::MemoryAllocator& mem)
+{
+    ForeignTest test;
+    GC::Thread owner;
+    test.step = 0;
+    if (!owner.start(ownForeignTree, &test)) { 
+        fprintf(stderr, "Failed to start thread\n");
+        return false;
+    }
+    GC::Var<Wood> holder = Wood::create(1);
+    waitStep(&test, 1);
+    (*holder)[0] = test.tree;
+    setStep(&test, 2);
+    waitStep(&test, 3);
+    bool ok = Tree::check((*holder)[0], parcelHeight);
+    mem.gc();
+    setStep(&test, 4);
+    waitStep(&test, 5);
+    ok = ok && Tree::check((*holder)[0], parcelHeight);
+    (*holder)[0] = NULL;
+    mem.gc();
+    setStep(&test, 6);
+    owner.join();
+    if (!ok) { 
+        fprintf(stderr, "Object referenced only from other heap is reclaimed by GC of its owner\n");
+        return false;
+    }
+    if (test.collectedLiveSize >= test.ownerLiveSize) { 
+        fprintf(stderr, "Object is not reclaimed after reference from other heap is cleared\n");
+        return false;
+    }
+    return true;
+}
+
+static void storeForeignTree(void* arg)
+{
+    GC::MemoryAllocator mem(1*Mb, 1*Mb);
+    GC::Var<Wood> holder = Wood::create(1);
+    (*holder)[0] = (Tree*)arg; // allocator is destroyed before its GC confirms the reference
+}
+
+static bool checkDestroyedSource(GC::MemoryAllocator& mem)
+{
+    GC::Var<Tree> tree = Tree::build(parcelHeight);
+    GC::Thread source;
+    if (!source.start(storeForeignTree, (Tree*)tree)) { 
+        fprintf(stderr, "Failed to start thread\n");
+        return false;
+    }
+    source.join();
+    mem.gc();
+    size_t liveSize = GC::MemoryAllocator::liveSize();
+    tree = NULL;
+    mem.gc();
+    if (GC::MemoryAllocator::liveSize() >= liveSize) { 
+        fprintf(stderr, "Object referenced from destroyed heap is not reclaimed\n");
+        return false;
+    }
+    return true;
+}
+
+typedef GC::ObjectArray<GC::String> Strings;
+typedef GC::ObjectArray<Wood> Woods;
+
+static bool checkPointerFree(GC::MemoryAllocator& mem)
+{
+    const size_t nObjects = 1000;
+    const size_t maxLength = 20000; // covers all size classes and large pages
+    GC::Var<Strings> strings = Strings::create(nObjects);
+    GC::Var<Woods> arrays = Woods::create(nObjects); // objects with references of the same sizes
+    char* buf = new char[maxLength + 1];
+    for (size_t i = 0; i < nObjects; i++) { 
+        size_t length = i*maxLength/nObjects;
+        memset(buf, 'a' + i % 26, length);
+        (*strings)[i] = GC::String::create(buf, length);
+        (*arrays)[i] = Wood::create(length/sizeof(Tree*) + 1);
+    }
+    mem.gc();
+    for (size_t i = 0; i < nObjects; i++) { 
+        GC::String* str = (*strings)[i];
+        size_t length = i*maxLength/nObjects;
+        memset(buf, 'a' + i % 26, length);
+        buf[length] = '\0';
+        if (str->size() != length || !str->equals(buf)) { 
+            fprintf(stderr, "Pointer-free object of size %d is corrupted by GC\n", (int)length);
+            return false;
+        }
+        if (!GC::MemoryPage::getPage(str)->pointerFree || GC::MemoryPage::getPage((*arrays)[i])->pointerFree) { 
+            fprintf(stderr, "Object of size %d is placed in page of wrong kind\n", (int)length);
+            return false;
+        }
+    }
+    delete[] buf;
+    return true;
+}
+
 int main(int argc, char* argv[]) 
 { 
     int nTrees = argc > 1 ? atoi(argv[1]) : 100;
@@ -68,6 +542,18 @@ int main(int argc, char* argv[])
                 (*wood)[tree] = Tree::build(height);
             }
         }
+        const int nIterations = 10;
+        clock_t gcStart = clock();
+        for (int i = 0; i < nIterations; i++) { 
+            mem.gc();
+        }
+        printf("GC time %.1f msec\n", (double)(clock() - gcStart)*1000/CLOCKS_PER_SEC/nIterations);
+    }
+    { 
+        GC::MemoryAllocator mem(1*Mb, 1*Mb); // small heap: checks start a lot of GCs
+        if (!checkFinalization(mem) || !checkBulkSweep(mem) || !checkPointerFree(mem) || !checkMarkRegion(mem) || !checkCompaction(mem) || !checkParcel(mem) || !checkParcelOuterRoot(mem) || !checkForeignReference(mem) || !checkDestroyedSource(mem)) { 
+            return EXIT_FAILURE;
+        }
     }
     printf("Elapsed time %d\n", (int)(time(NULL) - start));
     return EXIT_SUCCESS;
@@ -7,6 +7,7 @@
 namespace GC
 {
 
+#ifndef GC_THREAD_LOCAL
     ThreadContextImpl::ThreadContextImpl() 
     { 
         key = TlsAlloc();
@@ -26,6 +27,98 @@ namespace GC
     {
         TlsSetValue(key, value);
     }
+#endif
+
+    Mutex::Mutex()
+    {
+        impl = new CRITICAL_SECTION;
+        InitializeCriticalSection((CRITICAL_SECTION*)impl);
+    }
+
+    Mutex::~Mutex()
+    {
+        DeleteCriticalSection((CRITICAL_SECTION*)impl);
+        delete (CRITICAL_SECTION*)impl;
+    }
+
+    void Mutex::lock()
+    {
+        EnterCriticalSection((CRITICAL_SECTION*)impl);
+    }
+
+    void Mutex::unlock()
+    {
+        LeaveCriticalSection((CRITICAL_SECTION*)impl);
+    }
+
+    Event::Event()
+    {
+        impl = new CONDITION_VARIABLE;
+        InitializeConditionVariable((CONDITION_VARIABLE*)impl);
+    }
+
+    Event::~Event()
+    {
+        delete (CONDITION_VARIABLE*)impl;
+    }
+
+    void Event::wait(Mutex& mutex)
+    {
+        SleepConditionVariableCS((CONDITION_VARIABLE*)impl, (CRITICAL_SECTION*)mutex.impl, INFINITE);
+    }
+
+    void Event::signal()
+    {
+        WakeAllConditionVariable((CONDITION_VARIABLE*)impl);
+    }
+
+    struct ThreadArgs 
+    { 
+        Thread::Procedure proc;
+        void* arg;
+    };
+
+    static DWORD WINAPI threadProc(LPVOID param)
+    {
+        ThreadArgs args = *(ThreadArgs*)param;
+        delete (ThreadArgs*)param;
+        args.proc(args.arg);
+        return 0;
+    }
+
+    Thread::Thread()
+    {
+        impl = NULL;
+    }
+
+    Thread::~Thread()
+    {
+        if (impl != NULL) { 
+            CloseHandle((HANDLE)impl);
+        }
+    }
+
+    bool Thread::start(Procedure proc, void* arg)
+    {
+        ThreadArgs* args = new ThreadArgs();
+        args->proc = proc;
+        args->arg = arg;
+        impl = CreateThread(NULL, 0, threadProc, args, 0, NULL);
+        if (impl == NULL) { 
+            delete args;
+            return false;
+        }
+        return true;
+    }
+
+    void Thread::join()
+    {
+        if (impl != NULL) { 
+            WaitForSingleObject((HANDLE)impl, INFINITE);
+            CloseHandle((HANDLE)impl);
+            impl = NULL;
+        }
+    }
 };
 
 #else
@@ -35,6 +128,7 @@ namespace GC
 namespace GC
 {
 
+#ifndef GC_THREAD_LOCAL
     ThreadContextImpl::ThreadContextImpl() 
     { 
         pthread_key_create(&key, NULL);
@@ -54,6 +148,99 @@ namespace GC
     {
          pthread_setspecific(key, value);
     }
+#endif
+
+    Mutex::Mutex()
+    {
+        impl = new pthread_mutex_t;
+        pthread_mutex_init((pthread_mutex_t*)impl, NULL);
+    }
+
+    Mutex::~Mutex()
+    {
+        pthread_mutex_destroy((pthread_mutex_t*)impl);
+        delete (pthread_mutex_t*)impl;
+    }
+
+    void Mutex::lock()
+    {
+        pthread_mutex_lock((pthread_mutex_t*)impl);
+    }
+
+    void Mutex::unlock()
+    {
+        pthread_mutex_unlock((pthread_mutex_t*)impl);
+    }
+
+    Event::Event()
+    {
+        impl = new pthread_cond_t;
+        pthread_cond_init((pthread_cond_t*)impl, NULL);
+    }
+
+    Event::~Event()
+    {
+        pthread_cond_destroy((pthread_cond_t*)impl);
+        delete (pthread_cond_t*)impl;
+    }
+
+    void Event::wait(Mutex& mutex)
+    {
+        pthread_cond_wait((pthread_cond_t*)impl, (pthread_mutex_t*)mutex.impl);
+    }
+
+    void Event::signal()
+    {
+        pthread_cond_broadcast((pthread_cond_t*)impl);
+    }
+
+    struct ThreadArgs 
+    { 
+        Thread::Procedure proc;
+        void* arg;
+    };
+
+    static void* threadProc(void* param)
+    {
+        ThreadArgs args = *(ThreadArgs*)param;
+        delete (ThreadArgs*)param;
+        args.proc(args.arg);
+        return NULL;
+    }
+
+    Thread::Thread()
+    {
+        impl = NULL;
+    }
+
+    Thread::~Thread()
+    {
+        delete (pthread_t*)impl;
+    }
+
+    bool Thread::start(Procedure proc, void* arg)
+    {
+        ThreadArgs* args = new ThreadArgs();
+        args->proc = proc;
+        args->arg = arg;
+        pthread_t* thread = new pthread_t;
+        if (pthread_create(thread, NULL, threadProc, args) != 0) { 
+            delete thread;
+            delete args;
+            return false;
+        }
+        impl = thread;
+        return true;
+    }
+
+    void Thread::join()
+    {
+        if (impl != NULL) { 
+            pthread_join(*(pthread_t*)impl, NULL);
+            delete (pthread_t*)impl;
+            impl = NULL;
+        }
+    }
 };
 
 #endif